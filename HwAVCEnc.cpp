@@ -7,12 +7,26 @@
  * publication of such source code.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <dlfcn.h>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <sys/time.h>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "HwAVCEnc.h"
 #include "nvEncodeAPI.h"
+#include "x264.h"
 #include "ColorBuffer.h"
 #include "FrameBuffer.h"
 #include "OpenGLESDispatch/EGLDispatch.h"
@@ -50,14 +64,41 @@
 
 #define H264_ENCODE_GUID NV_ENC_CODEC_H264_GUID
 #define AV1_ENCODE_GUID NV_ENC_CODEC_AV1_GUID
-#define AVC_PRESET_GUID NV_ENC_PRESET_P2_GUID
 #define AVC_TUNING_INFO NV_ENC_TUNING_INFO_LOW_LATENCY
 
+#define AVC_MAX_FRAME_DECIMATION        4       // throttled sessions encode at least every 4th frame
+#define AVC_THROTTLE_INTERVAL_MS        1000    // min time between two throttle steps
+#define AVC_RELAX_INTERVAL_MS           5000    // time without saturation before a throttle step is undone
+
+#define AVC_OUTPUT_POOL_DEPTH           1       // frames in flight, encoding is synchronous
+
+#define AVC_SCALE_STEPS                 3       // encode resolution ladder of the adaptive mode
+#define AVC_SCALE_CHECK_INTERVAL_MS     1000
+#define AVC_SCALE_DOWN_BPP              0.04f   // step down below this many bits per pixel...
+#define AVC_SCALE_DOWN_CHECKS           3       // ...for 3 checks in a row
+#define AVC_SCALE_UP_BPP                0.06f   // step up once the larger step gets this many bits per pixel...
+#define AVC_SCALE_UP_CHECKS             5       // ...for 5 checks in a row
+
+#define AVC_LTR_THUMB_SIZE              16      // scene signature is a 16x16 RGBA thumbnail
+#define AVC_LTR_THUMB_BYTES             (AVC_LTR_THUMB_SIZE * AVC_LTR_THUMB_SIZE * 4)
+#define AVC_LTR_SCENE_SAD               (AVC_LTR_THUMB_SIZE * AVC_LTR_THUMB_SIZE * 3 * 12)  // avg diff 12 per channel
+#define AVC_LTR_MATCH_SAD               (AVC_LTR_THUMB_SIZE * AVC_LTR_THUMB_SIZE * 3 * 4)   // avg diff 4 per channel
+#define AVC_LTR_STABLE_FRAMES           30      // a scene is marked once it stayed for 30 frames
+#define AVC_LTR_THUMB_LEVELS            10      // halving blits down to the thumbnail, enough for 16k input
+
+#define AVC_SW_ENCODE_THREADS           4
+#define AVC_SW_CONVERT_THREADS          4
+
+#define AVC_STR(x)                      #x
+#define AVC_XSTR(x)                     AVC_STR(x)
+
 QpData qpData;
 int encSessionsCount = 0;         // number of active encoder sessions running
 bool pauseStream = false;
 ColorBufferSet avcCbSet;
 
+static const int scaleLadderPercent[AVC_SCALE_STEPS] = { 100, 75, 50 };
+
 typedef enum {
     LOW_BITRATE,
     MEDIUM_BITRATE,
@@ -66,16 +107,69 @@ typedef enum {
 
 extern const GLint* getGlesMaxContextAttribs();
 
+typedef NVENCSTATUS NVENCAPI (*NvEncodeAPICreateInstance_t)(NV_ENCODE_API_FUNCTION_LIST *functionList);
+// The GL resource description is kept alive until the texture is unregistered
+typedef struct
+{
+    NV_ENC_INPUT_RESOURCE_OPENGL_TEX    resource;
+    NV_ENC_REGISTERED_PTR               registeredResource;
+} AVCInputResource;
+
+typedef std::unordered_map<GLuint, AVCInputResource> BufferMap_t;
+
+typedef int (*x264ParamDefaultPreset_t)(x264_param_t* param, const char* preset, const char* tune);
+typedef int (*x264ParamApplyProfile_t)(x264_param_t* param, const char* profile);
+typedef x264_t* (*x264EncoderOpen_t)(x264_param_t* param);
+typedef int (*x264EncoderReconfig_t)(x264_t* encoder, x264_param_t* param);
+typedef int (*x264EncoderEncode_t)(x264_t* encoder, x264_nal_t** nals, int* numNals, x264_picture_t* picIn, x264_picture_t* picOut);
+typedef void (*x264EncoderClose_t)(x264_t* encoder);
+typedef void (*x264PictureInit_t)(x264_picture_t* pic);
+
 typedef struct
 {
-    NV_ENC_INPUT_RESOURCE_OPENGL_TEX        resource;           // input resource
-    NV_ENC_MAP_INPUT_RESOURCE               mapInputResource;
-    NV_ENC_PIC_PARAMS                       picParams;
-    NV_ENC_LOCK_BITSTREAM                   lockBitstreamData;  // output data
-} NvEncBufferInfo;
+    x264ParamDefaultPreset_t        x264ParamDefaultPreset;
+    x264ParamApplyProfile_t         x264ParamApplyProfile;
+    x264EncoderOpen_t               x264EncoderOpen;
+    x264EncoderReconfig_t           x264EncoderReconfig;
+    x264EncoderEncode_t             x264EncoderEncode;
+    x264EncoderClose_t              x264EncoderClose;
+    x264PictureInit_t               x264PictureInit;
+    x264_t*                         encoder;
+    x264_param_t                    param;
+    int                             scaleShift;     // encode at input size >> scaleShift
+    int                             encodeWidth;
+    int                             encodeHeight;
+    uint8_t*                        rgba;           // colour buffer readback
+    uint8_t*                        scaled;
+    uint8_t*                        nv12;
+} AVCSwEncoder;
 
-typedef NVENCSTATUS NVENCAPI (*NvEncodeAPICreateInstance_t)(NV_ENCODE_API_FUNCTION_LIST *functionList);
-typedef std::unordered_map<GLuint, NvEncBufferInfo*> BufferMap_t;
+typedef struct
+{
+    void*                           data;
+    uint32_t                        size;
+    bool                            isIDR;
+    uint32_t                        temporalId;
+    AVCPictureType                  pictureType;
+    int                             qp;             // -1 if unknown
+    bool                            ltrMarked;
+    bool                            ltrUsed;
+    int                             ltrIdx;
+} AVCEncodedFrame;
+
+typedef struct
+{
+    bool                            valid;
+    uint8_t                         thumb[AVC_LTR_THUMB_BYTES];
+} AVCLtrSlot;
+
+typedef struct
+{
+    AVCRoiRect                      rect;
+    timeval                         setTime;
+} AVCRoiHint;
+
+static_assert(sizeof(AVCFrameHeaderV2) == 32, "AVCFrameHeaderV2 is part of the output protocol");
 
 typedef struct
 {
@@ -89,12 +183,109 @@ typedef struct
     NV_ENC_BUFFER_FORMAT            format;
     EGLSurface                      eglSurface;
     EGLContext                      eglContext;
-    BufferMap_t                     bufferMap;
+    BufferMap_t                     bufferMap;      // registered input textures
     bool                            isIVS;       // for live streaming through AWS-IVS
     GLuint                          overwriteTex;   // for paused stream
-    NvEncBufferInfo*                overwriteNvencBufInfo;
+    AVCInputResource                overwriteInput;
+    NV_ENC_PIC_PARAMS               picParams;
+    NV_ENC_MAP_INPUT_RESOURCE       mapInputResource;   // input of the frame being encoded
+    NV_ENC_LOCK_BITSTREAM           lockBitstreamData;  // output data
+    NV_ENC_OUTPUT_PTR               outputPool[AVC_OUTPUT_POOL_DEPTH];
+    uint32_t                        outputPoolIndex;
+    AVCSessionRole                  role;
+    AVCSessionPriority              priority;
+    int                             fps;
+    int                             baseDecimation; // frame decimation granted on admission
+    std::atomic<int>                decimation;     // current decimation, raised under encoder saturation
+    uint32_t                        frameCount;
+    int                             encodeTimeUs;   // smoothed encode time per frame
+    int                             temporalLayers;
+    const struct AVCEncoderBackend* backend;
+    bool                            isHwSession;    // counted against the NVENC session and pixel rate budget
+    AVCSwEncoder*                   swEncoder;
+    int                             swScaleShift;
+    int                             framingVersion;
+    uint32_t                        sequence;       // output frame sequence number of framing v2
+    int                             encodeWidth;    // current step of the resolution ladder
+    int                             encodeHeight;
+    bool                            adaptiveResolution;
+    int                             scaleStep;
+    GLuint                          blitFbo[2];     // blit read/draw framebuffers
+    GLuint                          scaledTex[AVC_SCALE_STEPS];     // step 0 encodes the input directly
+    AVCInputResource                scaledInput[AVC_SCALE_STEPS];
+    timeval                         scaleCheckTime;
+    uint64_t                        scaleBitrateSum;
+    uint32_t                        scaleFrames;
+    int                             scaleDownChecks;
+    int                             scaleUpChecks;
+    bool                            usesQp;         // qp delta map and dynQpAdjust set up by this session
+    uint32_t                        widthInMBs;     // qp delta map of the encoded picture size
+    uint32_t                        heightInMBs;
+    uint32_t                        qpDeltaMapArraySize;
+    int8_t*                         qpDeltaMapArray;
+    int                             ltrFrames;
+    AVCLtrSlot                      ltrSlots[AVC_MAX_LTR_FRAMES];
+    int                             ltrNextSlot;
+    int                             ltrLastMarked;  // -1 if no slot is valid
+    GLuint                          ltrThumbTex;
+    GLuint                          ltrLevelTex[AVC_LTR_THUMB_LEVELS];
+    int                             ltrLevelWidth[AVC_LTR_THUMB_LEVELS];
+    int                             ltrLevelHeight[AVC_LTR_THUMB_LEVELS];
+    int                             ltrLevels;
+    GLuint                          ltrPbo[2];      // thumbnail readback, one is written while the other is read
+    uint32_t                        ltrReadbacks;
+    uint8_t                         ltrThumb[AVC_LTR_THUMB_BYTES];      // signature of the current frame, if ltrHaveThumb
+    bool                            ltrHaveThumb;
+    uint8_t                         ltrPrevThumb[AVC_LTR_THUMB_BYTES];  // signature of the previous frame, from the PBO
+    uint8_t                         ltrOlderThumb[AVC_LTR_THUMB_BYTES]; // signature of the frame before
+    bool                            ltrHaveOlder;
+    uint32_t                        ltrStableFrames;
+    bool                            ltrSceneMarked;
+    std::mutex                      roiLock;        // hints may be set from another thread
+    std::vector<AVCRoiHint>         roiHints;       // session hints
+    std::vector<AVCRoiRect>         roiFrameRects;  // hints of the current frame
+    bool                            roiDirty;
+    std::vector<int8_t>             roiMap;         // rasterized hints, one qp offset per macroblock
+    uint32_t                        roiMapWidthInMBs;
+    uint32_t                        roiMapHeightInMBs;
 } AVCEncoderContext;
 
+// Encoder implementation behind AVCCreateEncoder/AVCEncodeBuffer/AVCDestroyEncoder
+typedef struct AVCEncoderBackend
+{
+    const char* name;
+    bool (*init)(AVCEncoderContext* ctx, Codec codecType, int width, int height, int fps, int bitrate);
+    // on success frame stays valid until releaseFrame
+    bool (*encodeFrame)(AVCEncoderContext* ctx, uint32_t colorBuffer, uint64_t inTimestamp, int reqIDRFrame, uint32_t bitrate, AVCEncodedFrame* frame);
+    void (*releaseFrame)(AVCEncoderContext* ctx);
+    void (*destroy)(AVCEncoderContext* ctx);
+} AVCEncoderBackend;
+
+typedef struct
+{
+    std::mutex                      lock;
+    std::vector<AVCEncoderContext*> sessions;
+    int                             maxSessions;
+    uint64_t                        maxPixelRate;   // pixels per second over all sessions
+    timeval                         lastThrottleTime;
+    timeval                         lastSaturatedTime;
+} AVCSessionManager;
+
+static AVCSessionManager sessionManager = { {}, {}, 0, 0, {0}, {0} };     // unlimited until AVCSetSessionLimits
+
+// libnvidia-encode is loaded and probed once, sessions copy the function list
+typedef struct
+{
+    std::mutex                      lock;
+    bool                            loadTried;
+    void*                           handle;
+    NV_ENCODE_API_FUNCTION_LIST     nvenc;
+    bool                            capsProbed;
+    AVCEncoderCaps                  caps;
+} AVCNvencLoader;
+
+static AVCNvencLoader nvencLoader;
+
 dynQpDeltaAdjustMsg* dynQpAdjust= NULL;
 #define BYTES2BITS(a)    ((a)*8)
 
@@ -314,309 +505,1374 @@ static void destroyEGLResources(AVCEncoderContext* ctx)
         eglDestroySurface(dpy, ctx->eglSurface);
 }
 
-static bool AVCPrepareIOBuffers(AVCEncoderContext* ctx, NvEncBufferInfo* nvencBufInfo, GLuint tex)
+static int64_t sessionElapsedUs(const timeval& startTime)
 {
-    nvencBufInfo->resource.texture = tex;
-    nvencBufInfo->resource.target = GL_TEXTURE_2D;
-
-    // register input resource
-    NV_ENC_REGISTER_RESOURCE registerResource = { NV_ENC_REGISTER_RESOURCE_VER };
-    registerResource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_OPENGL_TEX;
-    registerResource.width = ctx->width;
-    registerResource.height = ctx->height;
-    registerResource.pitch = ctx->width * 4;
-    registerResource.subResourceIndex = 0;
-    registerResource.resourceToRegister = &(nvencBufInfo->resource);
-    registerResource.bufferFormat = ctx->format;
-    registerResource.bufferUsage = NV_ENC_INPUT_IMAGE;
-    NVENC_API_CALL_RET(ctx->nvenc.nvEncRegisterResource(ctx->encoder, &registerResource), false);
+    timeval currentTime;
+    gettimeofday(&currentTime, NULL);
+    return (int64_t)(currentTime.tv_sec - startTime.tv_sec) * 1000000 + (currentTime.tv_usec - startTime.tv_usec);
+}
 
-    nvencBufInfo->mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
-    nvencBufInfo->mapInputResource.registeredResource = registerResource.registeredResource;
+static int64_t sessionElapsedMs(const timeval& startTime)
+{
+    return sessionElapsedUs(startTime) / 1000;
+}
 
-    nvencBufInfo->picParams = { NV_ENC_PIC_PARAMS_VER };
-    nvencBufInfo->picParams.inputWidth = ctx->width;
-    nvencBufInfo->picParams.inputHeight = ctx->height;
-    nvencBufInfo->picParams.inputPitch = ctx->width * 4;
-    nvencBufInfo->picParams.inputBuffer = nvencBufInfo->mapInputResource.mappedResource;
-    nvencBufInfo->picParams.bufferFmt = ctx->format;
-    nvencBufInfo->picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+static uint64_t sessionPixelRate(const AVCEncoderContext* ctx, int decimation)
+{
+    return (uint64_t)ctx->encodeWidth * ctx->encodeHeight * ctx->fps / decimation;
+}
 
-    // create bitstream buffer for output
-    NV_ENC_CREATE_BITSTREAM_BUFFER createBitstreamBuffer = { NV_ENC_CREATE_BITSTREAM_BUFFER_VER };
-    NVENC_API_CALL_RET(ctx->nvenc.nvEncCreateBitstreamBuffer(ctx->encoder, &createBitstreamBuffer), false);
-    nvencBufInfo->picParams.outputBitstream = createBitstreamBuffer.bitstreamBuffer;
+// caller holds sessionManager.lock
+static uint64_t sessionTotalPixelRateLocked()
+{
+    uint64_t total = 0;
+    for (AVCEncoderContext* s : sessionManager.sessions) {
+        if (s->isHwSession)
+            total += sessionPixelRate(s, s->decimation);
+    }
+    return total;
+}
 
-    nvencBufInfo->lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
-    nvencBufInfo->lockBitstreamData.outputBitstream = createBitstreamBuffer.bitstreamBuffer;
-    nvencBufInfo->lockBitstreamData.doNotWait = 0;
+// Doubles the decimation of the lowest priority session below maxPriority, caller holds sessionManager.lock
+static bool sessionThrottleLowestLocked(AVCSessionPriority maxPriority)
+{
+    AVCEncoderContext* victim = NULL;
+    for (AVCEncoderContext* s : sessionManager.sessions) {
+        if (!s->isHwSession || s->priority >= maxPriority || s->decimation >= AVC_MAX_FRAME_DECIMATION)
+            continue;
+        if (!victim || s->priority < victim->priority)
+            victim = s;
+    }
+    if (!victim)
+        return false;
 
+    victim->decimation = victim->decimation * 2;
+    gettimeofday(&sessionManager.lastThrottleTime, NULL);
+    HDLOGI("%s: throttle encoder=0x%" PRIx64 " priority=%d decimation=%d\n", __FUNCTION__, (AVCEncCtx)victim, victim->priority, (int)victim->decimation);
     return true;
 }
 
-AVCEncCtx AVCCreateEncoder(int codec, int width, int height, int fps, int bitrate)
+// Undoes one throttle step of the highest priority throttled session, caller holds sessionManager.lock
+static void sessionRelaxHighestLocked()
 {
-    AVCEncoderContext* ctx = new AVCEncoderContext;
-    Codec codecType = (Codec)codec;
-    ctx->width = width;
-    ctx->height = height;
-    ctx->bitrate = bitrate;
-    ctx->minBitrate = bitrate / 2.5;
-    ctx->format = NV_ENC_BUFFER_FORMAT_ABGR;
+    AVCEncoderContext* target = NULL;
+    for (AVCEncoderContext* s : sessionManager.sessions) {
+        if (!s->isHwSession || s->decimation <= s->baseDecimation)
+            continue;
+        if (!target || s->priority > target->priority)
+            target = s;
+    }
+    if (!target)
+        return;
 
-    if (!setupEGLResources(ctx, width, height))
-        return 0;
+    uint64_t relaxedRate = sessionTotalPixelRateLocked() + sessionPixelRate(target, target->decimation);
+    if (sessionManager.maxPixelRate && relaxedRate > sessionManager.maxPixelRate)
+        return;
 
-    void* handle = dlopen("libnvidia-encode.so", RTLD_LAZY);
-    if (!handle) {
-        HDLOGE(":::: %s dlopen libnvidia-encode.so failed error=%s\n", __FUNCTION__, dlerror());
-        return 0;
+    target->decimation = target->decimation / 2;
+    gettimeofday(&sessionManager.lastThrottleTime, NULL);
+    HDLOGI("%s: relax encoder=0x%" PRIx64 " priority=%d decimation=%d\n", __FUNCTION__, (AVCEncCtx)target, target->priority, (int)target->decimation);
+}
+
+static int sessionHwCountLocked()
+{
+    int count = 0;
+    for (AVCEncoderContext* s : sessionManager.sessions) {
+        if (s->isHwSession)
+            count++;
     }
+    return count;
+}
 
-    NvEncodeAPICreateInstance_t nvEncodeAPICreateInstance = (NvEncodeAPICreateInstance_t) dlsym(handle, "NvEncodeAPICreateInstance");
-    if (!nvEncodeAPICreateInstance) {
-        HDLOGE(":::: %s dlsym NvEncodeAPICreateInstance failed error=%s\n", __FUNCTION__, dlerror());
-        return 0;
+// hwEncoder sessions are checked against the NVENC limits, software ones are only registered
+static bool sessionAdmit(AVCEncoderContext* ctx, const AVCEncoderOptions* options, bool hwEncoder)
+{
+    std::lock_guard<std::mutex> guard(sessionManager.lock);
+
+    ctx->role = options->role;
+    if (ctx->role == AVC_SESSION_ROLE_AUTO) {
+        ctx->role = AVC_SESSION_ROLE_STREAMER;
+        for (AVCEncoderContext* s : sessionManager.sessions) {
+            if (s->role == AVC_SESSION_ROLE_STREAMER) {
+                ctx->role = AVC_SESSION_ROLE_IVS;
+                break;
+            }
+        }
+    }
+    ctx->isIVS = (ctx->role == AVC_SESSION_ROLE_IVS);
+
+    ctx->priority = options->priority;
+    if (ctx->priority == AVC_SESSION_PRIORITY_DEFAULT)
+        ctx->priority = ctx->isIVS ? AVC_SESSION_PRIORITY_LOW : AVC_SESSION_PRIORITY_HIGH;
+
+    ctx->isHwSession = hwEncoder;
+    if (!hwEncoder) {
+        ctx->baseDecimation = 1;
+        ctx->decimation = 1;
+        sessionManager.sessions.push_back(ctx);
+        encSessionsCount++;
+        return true;
     }
 
-    ctx->nvenc = { NV_ENCODE_API_FUNCTION_LIST_VER };
-    NVENC_API_CALL_RET(nvEncodeAPICreateInstance(&ctx->nvenc), 0);
+    if (sessionManager.maxSessions && sessionHwCountLocked() >= sessionManager.maxSessions) {
+        HDLOGE(":::: %s: session limit reached (%d), reject role=%d priority=%d\n", __FUNCTION__, sessionManager.maxSessions, ctx->role, ctx->priority);
+        return false;
+    }
 
-    if (!ctx->nvenc.nvEncOpenEncodeSessionEx) {
-        HDLOGE(":::: %s EncodeAPI not found\n", __FUNCTION__);
-        return 0;
+    int decimation = 1;
+    if (sessionManager.maxPixelRate) {
+        if (ctx->priority == AVC_SESSION_PRIORITY_HIGH) {
+            // high priority sessions are never downgraded, lower priority ones make room instead
+            while (sessionTotalPixelRateLocked() + sessionPixelRate(ctx, 1) > sessionManager.maxPixelRate &&
+                   sessionThrottleLowestLocked(ctx->priority));
+            // nothing left to throttle, let the caller fall back to the software encoder
+            uint64_t used = sessionTotalPixelRateLocked();
+            if (used + sessionPixelRate(ctx, 1) > sessionManager.maxPixelRate) {
+                HDLOGE(":::: %s: pixel rate budget exhausted after throttling (%" PRIu64 "/%" PRIu64 "), reject role=%d priority=%d\n", __FUNCTION__, used, sessionManager.maxPixelRate, ctx->role, ctx->priority);
+                return false;
+            }
+        }
+        else {
+            uint64_t used = sessionTotalPixelRateLocked();
+            while (used + sessionPixelRate(ctx, decimation) > sessionManager.maxPixelRate &&
+                   decimation < AVC_MAX_FRAME_DECIMATION)
+                decimation *= 2;
+            if (used + sessionPixelRate(ctx, decimation) > sessionManager.maxPixelRate) {
+                HDLOGE(":::: %s: pixel rate budget exhausted (%" PRIu64 "/%" PRIu64 "), reject role=%d priority=%d\n", __FUNCTION__, used, sessionManager.maxPixelRate, ctx->role, ctx->priority);
+                return false;
+            }
+            if (decimation > 1)
+                HDLOGI("%s: pixel rate budget low, downgrade role=%d priority=%d to decimation=%d\n", __FUNCTION__, ctx->role, ctx->priority, decimation);
+        }
     }
 
-    NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS encodeSessionExParams = { NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER };
-    encodeSessionExParams.device = NULL;
-    encodeSessionExParams.deviceType = NV_ENC_DEVICE_TYPE_OPENGL;
-    encodeSessionExParams.apiVersion = NVENCAPI_VERSION;
-    ctx->encoder = NULL;
-    NVENC_API_CALL_RET(ctx->nvenc.nvEncOpenEncodeSessionEx(&encodeSessionExParams, &ctx->encoder), 0);
+    ctx->baseDecimation = decimation;
+    ctx->decimation = decimation;
+    sessionManager.sessions.push_back(ctx);
+    encSessionsCount++;
+    return true;
+}
 
-    // track encoder
-    RenderThreadInfo* const tinfo = RenderThreadInfo::get();
-    FrameBuffer::getFB()->lock();
-    tinfo->m_avcEncSet.insert((AVCEncCtx)ctx);
-    FrameBuffer::getFB()->unlock();
+static void sessionRelease(AVCEncoderContext* ctx)
+{
+    std::lock_guard<std::mutex> guard(sessionManager.lock);
+
+    bool ivsRunning = false;
+    for (std::vector<AVCEncoderContext*>::iterator it = sessionManager.sessions.begin(); it != sessionManager.sessions.end(); ) {
+        if (*it == ctx) {
+            it = sessionManager.sessions.erase(it);
+            encSessionsCount--;
+            continue;
+        }
+        if ((*it)->isIVS)
+            ivsRunning = true;
+        ++it;
+    }
+    if (!ivsRunning)
+        pauseStream = false;
+}
 
-    ctx->reconfigParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
-    ctx->reconfigParams.reInitEncodeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
-    ctx->reconfigParams.reInitEncodeParams.presetGUID = AVC_PRESET_GUID;
-    ctx->reconfigParams.reInitEncodeParams.encodeWidth = width;
-    ctx->reconfigParams.reInitEncodeParams.encodeHeight = height;
-    ctx->reconfigParams.reInitEncodeParams.darWidth = width;
-    ctx->reconfigParams.reInitEncodeParams.darHeight = height;
-    ctx->reconfigParams.reInitEncodeParams.frameRateNum = fps;
-    ctx->reconfigParams.reInitEncodeParams.frameRateDen = 1;
-    ctx->reconfigParams.reInitEncodeParams.enableEncodeAsync = 0;
-    ctx->reconfigParams.reInitEncodeParams.enablePTD = 1;
-    ctx->reconfigParams.reInitEncodeParams.reportSliceOffsets = 0;
-    ctx->reconfigParams.reInitEncodeParams.enableSubFrameWrite = 0;
-    ctx->reconfigParams.reInitEncodeParams.enableMEOnlyMode = 0;
-    ctx->reconfigParams.reInitEncodeParams.enableOutputInVidmem = 0;
+// Throttles low priority sessions when an encode takes most of its frame interval, relaxes them once it recovers
+static void sessionReportEncodeTime(AVCEncoderContext* ctx, int encodeTimeUs)
+{
+    ctx->encodeTimeUs = ctx->encodeTimeUs ? (ctx->encodeTimeUs * 7 + encodeTimeUs) / 8 : encodeTimeUs;
+    bool saturated = ctx->encodeTimeUs * ctx->fps > 750000;     // over 75% of the frame interval
+
+    std::lock_guard<std::mutex> guard(sessionManager.lock);
+    if (saturated) {
+        gettimeofday(&sessionManager.lastSaturatedTime, NULL);
+        if (sessionElapsedMs(sessionManager.lastThrottleTime) > AVC_THROTTLE_INTERVAL_MS)
+            sessionThrottleLowestLocked(AVC_SESSION_PRIORITY_HIGH);
+    }
+    else if (sessionElapsedMs(sessionManager.lastSaturatedTime) > AVC_RELAX_INTERVAL_MS &&
+             sessionElapsedMs(sessionManager.lastThrottleTime) > AVC_RELAX_INTERVAL_MS) {
+        sessionRelaxHighestLocked();
+    }
+}
 
-    NV_ENC_PRESET_CONFIG presetConfig = { NV_ENC_PRESET_CONFIG_VER, { NV_ENC_CONFIG_VER } };
-    ctx->reconfigParams.reInitEncodeParams.encodeConfig = new NV_ENC_CONFIG;
+void AVCInitEncoderOptions(AVCEncoderOptions* options)
+{
+    options->role = AVC_SESSION_ROLE_AUTO;
+    options->priority = AVC_SESSION_PRIORITY_DEFAULT;
+    options->temporalLayers = 0;
+    options->softwareFallback = true;
+    options->softwareScaleShift = 1;
+    options->framingVersion = AVC_FRAMING_V1;
+    options->adaptiveResolution = false;
+    options->ltrFrames = 0;
+}
 
-    switch (codecType) {
-        case AV1:
-            qpData.isQpEnabled = false;     // don't use qp for av1 codec
-            ctx->reconfigParams.reInitEncodeParams.encodeGUID = AV1_ENCODE_GUID;
-            NVENC_API_CALL_RET(ctx->nvenc.nvEncGetEncodePresetConfigEx(ctx->encoder, AV1_ENCODE_GUID, AVC_PRESET_GUID, AVC_TUNING_INFO, &presetConfig), 0);
-            memcpy(ctx->reconfigParams.reInitEncodeParams.encodeConfig, &(presetConfig.presetCfg), sizeof(NV_ENC_CONFIG));
+int AVCNegotiateFramingVersion(int clientMaxVersion)
+{
+    return std::max(AVC_FRAMING_V1, std::min(clientMaxVersion, AVC_FRAMING_VERSION_MAX));
+}
 
-            ctx->reconfigParams.reInitEncodeParams.encodeConfig->profileGUID = NV_ENC_AV1_PROFILE_MAIN_GUID;
-            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.av1Config.level = NV_ENC_LEVEL_AV1_AUTOSELECT;
-            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.av1Config.useBFramesAsRef = NV_ENC_BFRAME_REF_MODE_DISABLED;
-            break;
+void AVCSetSessionLimits(int maxSessions, uint64_t maxPixelRate)
+{
+    std::lock_guard<std::mutex> guard(sessionManager.lock);
+    sessionManager.maxSessions = maxSessions;
+    sessionManager.maxPixelRate = maxPixelRate;
+    HDLOGI("%s: maxSessions=%d maxPixelRate=%" PRIu64 "\n", __FUNCTION__, maxSessions, maxPixelRate);
+}
 
-        case H264:
-            ctx->reconfigParams.reInitEncodeParams.encodeGUID = H264_ENCODE_GUID;
-            NVENC_API_CALL_RET(ctx->nvenc.nvEncGetEncodePresetConfigEx(ctx->encoder, H264_ENCODE_GUID, AVC_PRESET_GUID, AVC_TUNING_INFO, &presetConfig), 0);
-            memcpy(ctx->reconfigParams.reInitEncodeParams.encodeConfig, &(presetConfig.presetCfg), sizeof(NV_ENC_CONFIG));
+// BT.601 limited range. Y uses 7 bit coefficients so that the AVX2 kernel can use pmaddubsw,
+// every kernel produces bit exact output of the scalar one.
+static inline uint8_t rgbToY(int r, int g, int b)
+{
+    return (uint8_t)(((33 * r + 64 * g + 13 * b + 64) >> 7) + 16);
+}
 
-            ctx->reconfigParams.reInitEncodeParams.encodeConfig->profileGUID = NV_ENC_H264_PROFILE_BASELINE_GUID;
-            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.level = NV_ENC_LEVEL_AUTOSELECT;
-            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.repeatSPSPPS = 1;
-            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.disableSPSPPS = 0;
-            break;
+static inline uint8_t rgbToU(int r, int g, int b)
+{
+    return (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
 
-        default:
-            HDLOGE(":::: Invalid codecType=%d\n", codecType);
-            return 0;
+static inline uint8_t rgbToV(int r, int g, int b)
+{
+    return (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+typedef int (*ConvertRowPair_t)(const uint8_t* src0, const uint8_t* src1, uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width);
+
+// converts two rows, starting at pixel x, returns the width
+static int convertRowPairScalar(const uint8_t* src0, const uint8_t* src1, uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width, int x)
+{
+    for (; x < width; x += 2) {
+        const uint8_t* p00 = src0 + x * 4;
+        const uint8_t* p01 = p00 + 4;
+        const uint8_t* p10 = src1 + x * 4;
+        const uint8_t* p11 = p10 + 4;
+        dstY0[x]     = rgbToY(p00[0], p00[1], p00[2]);
+        dstY0[x + 1] = rgbToY(p01[0], p01[1], p01[2]);
+        dstY1[x]     = rgbToY(p10[0], p10[1], p10[2]);
+        dstY1[x + 1] = rgbToY(p11[0], p11[1], p11[2]);
+
+        int r = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+        int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+        int b = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+        dstUV[x]     = rgbToU(r, g, b);
+        dstUV[x + 1] = rgbToV(r, g, b);
     }
+    return width;
+}
 
-    ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.averageBitRate = bitrate;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.maxBitRate = bitrate;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.idrPeriod = 60;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.enableAQ = 1;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.enableTemporalAQ = 1;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->gopLength = 30;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.enableLookahead = 1;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.disableIadapt = 0;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.disableBadapt = 1;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->frameIntervalP = 1;
-    ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableConstrainedEncoding = 1;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableIntraRefresh = 1;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.intraRefreshPeriod = 30;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableScalabilityInfoSEI = 1;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableTemporalSVC = 1;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.numTemporalLayers = 2;
-    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.maxTemporalLayers = 2;
+static int convertRowPairC(const uint8_t* src0, const uint8_t* src1, uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width)
+{
+    return convertRowPairScalar(src0, src1, dstY0, dstY1, dstUV, width, 0);
+}
 
-    if (qpData.isQpEnabled) {
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static inline __m256i convertYAvx2(const uint8_t* src)
+{
+    const __m256i kY = _mm256_setr_epi8(33, 64, 13, 0, 33, 64, 13, 0, 33, 64, 13, 0, 33, 64, 13, 0,
+                                        33, 64, 13, 0, 33, 64, 13, 0, 33, 64, 13, 0, 33, 64, 13, 0);
+    const __m256i kRound = _mm256_set1_epi16(64);
+    const __m256i kOffset = _mm256_set1_epi16(16);
+
+    __m256i p0 = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(src)), kY);
+    __m256i p1 = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(src + 32)), kY);
+    __m256i p2 = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(src + 64)), kY);
+    __m256i p3 = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(src + 96)), kY);
+    __m256i y01 = _mm256_hadd_epi16(p0, p1);
+    __m256i y23 = _mm256_hadd_epi16(p2, p3);
+    y01 = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(y01, kRound), 7), kOffset);
+    y23 = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(y23, kRound), 7), kOffset);
+    // hadd and packus work per 128 bit lane, restore pixel order
+    return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(y01, y23), _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
 
-        if (qpData.isDynamicMode()) {
-            dynQpAdjust = new dynQpDeltaAdjustMsg(ctx);
-            HDLOGI("%s: Dynamic Qpdelta adjustment algorithm take effect\n", __FUNCTION__);
+// U and V of 4 chroma pixels from 8 pixels of two rows, as [U0 U1 V0 V1 | U2 U3 V2 V3] int32
+__attribute__((target("avx2")))
+static inline __m256i convertUVAvx2(const uint8_t* src0, const uint8_t* src1)
+{
+    const __m256i kZero = _mm256_setzero_si256();
+    const __m256i kU = _mm256_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0, -38, -74, 112, 0, -38, -74, 112, 0);
+    const __m256i kV = _mm256_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0, 112, -94, -18, 0, 112, -94, -18, 0);
+
+    __m256i r0 = _mm256_loadu_si256((const __m256i*)src0);
+    __m256i r1 = _mm256_loadu_si256((const __m256i*)src1);
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(r0, kZero), _mm256_unpacklo_epi8(r1, kZero));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(r0, kZero), _mm256_unpackhi_epi8(r1, kZero));
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+    __m256i avg = _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_set1_epi16(2)), 2);
+    __m256i uv = _mm256_hadd_epi32(_mm256_madd_epi16(avg, kU), _mm256_madd_epi16(avg, kV));
+    return _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(uv, _mm256_set1_epi32(128)), 8), _mm256_set1_epi32(128));
+}
+
+__attribute__((target("avx2")))
+static int convertRowPairAvx2(const uint8_t* src0, const uint8_t* src1, uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width)
+{
+    const __m256i kInterleave = _mm256_setr_epi8(0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12, 14, 13, 15,
+                                                 0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12, 14, 13, 15);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        _mm256_storeu_si256((__m256i*)(dstY0 + x), convertYAvx2(src0 + x * 4));
+        _mm256_storeu_si256((__m256i*)(dstY1 + x), convertYAvx2(src1 + x * 4));
+
+        for (int c = 0; c < 32; c += 16) {
+            const uint8_t* s0 = src0 + (x + c) * 4;
+            const uint8_t* s1 = src1 + (x + c) * 4;
+            __m256i uv = _mm256_packs_epi32(convertUVAvx2(s0, s1), convertUVAvx2(s0 + 32, s1 + 32));
+            uv = _mm256_shuffle_epi8(_mm256_packus_epi16(uv, uv), kInterleave);
+            uv = _mm256_permutevar8x32_epi32(uv, _mm256_setr_epi32(0, 4, 1, 5, 0, 4, 1, 5));
+            _mm_storeu_si128((__m128i*)(dstUV + x + c), _mm256_castsi256_si128(uv));
         }
-        ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.rateControlMode = NV_ENC_PARAMS_RC_CONSTQP;
-        HDLOGI("%s: QP is enabled, lowBitQpValue=%d, mediumBitQpValue=%d, highBitQpValue=%d, qpValueOffset=%d\n", __FUNCTION__, qpData.lowBitQpValue, qpData.mediumBitQpValue, qpData.highBitQpValue, qpData.qpValueOffset);
+    }
+    return convertRowPairScalar(src0, src1, dstY0, dstY1, dstUV, width, x);
+}
+#endif
 
-        ctx->reconfigParams.reInitEncodeParams.encodeConfig->profileGUID = NV_ENC_H264_PROFILE_MAIN_GUID;
-        ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CABAC;
-        ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+#if defined(__aarch64__) || defined(__ARM_NEON)
+static inline uint8x8_t convertYNeon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+    uint16x8_t y = vmull_u8(r, vdup_n_u8(33));
+    y = vmlal_u8(y, g, vdup_n_u8(64));
+    y = vmlal_u8(y, b, vdup_n_u8(13));
+    return vadd_u8(vrshrn_n_u16(y, 7), vdup_n_u8(16));
+}
 
-        qpData.widthInMBs  = ((width + 15) & ~15) >> 4;
-        qpData.heightInMBs = ((height + 15) & ~15) >> 4;
-        qpData.qpDeltaMapArraySize  = qpData.widthInMBs * qpData.heightInMBs;
-        qpData.qpDeltaMapArray      = (int8_t*) malloc(qpData.qpDeltaMapArraySize * sizeof(int8_t));
-        memset(qpData.qpDeltaMapArray, 0, qpData.qpDeltaMapArraySize);
-    }
-    else {
-        HDLOGI("%s: QP is disabled\n", __FUNCTION__);
+static inline uint8x8_t convertChromaNeon(int16x8_t r, int16x8_t g, int16x8_t b, int16_t cr, int16_t cg, int16_t cb)
+{
+    int16x8_t c = vmulq_n_s16(r, cr);
+    c = vmlaq_n_s16(c, g, cg);
+    c = vmlaq_n_s16(c, b, cb);
+    return vqmovun_s16(vaddq_s16(vrshrq_n_s16(c, 8), vdupq_n_s16(128)));
+}
+
+static int convertRowPairNeon(const uint8_t* src0, const uint8_t* src1, uint8_t* dstY0, uint8_t* dstY1, uint8_t* dstUV, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t p0 = vld4q_u8(src0 + x * 4);
+        uint8x16x4_t p1 = vld4q_u8(src1 + x * 4);
+
+        vst1q_u8(dstY0 + x, vcombine_u8(convertYNeon(vget_low_u8(p0.val[0]), vget_low_u8(p0.val[1]), vget_low_u8(p0.val[2])),
+                                        convertYNeon(vget_high_u8(p0.val[0]), vget_high_u8(p0.val[1]), vget_high_u8(p0.val[2]))));
+        vst1q_u8(dstY1 + x, vcombine_u8(convertYNeon(vget_low_u8(p1.val[0]), vget_low_u8(p1.val[1]), vget_low_u8(p1.val[2])),
+                                        convertYNeon(vget_high_u8(p1.val[0]), vget_high_u8(p1.val[1]), vget_high_u8(p1.val[2]))));
+
+        int16x8_t r = vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(p0.val[0]), p1.val[0]), 2));
+        int16x8_t g = vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(p0.val[1]), p1.val[1]), 2));
+        int16x8_t b = vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(p0.val[2]), p1.val[2]), 2));
+        uint8x8x2_t uv;
+        uv.val[0] = convertChromaNeon(r, g, b, -38, -74, 112);
+        uv.val[1] = convertChromaNeon(r, g, b, 112, -94, -18);
+        vst2_u8(dstUV + x, uv);
     }
+    return convertRowPairScalar(src0, src1, dstY0, dstY1, dstUV, width, x);
+}
+#endif
 
-    ctx->reconfigParams.reInitEncodeParams.maxEncodeWidth = width;
-    ctx->reconfigParams.reInitEncodeParams.maxEncodeHeight = height;
-    ctx->reconfigParams.reInitEncodeParams.tuningInfo = AVC_TUNING_INFO;
+static ConvertRowPair_t selectConvertKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return convertRowPairAvx2;
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+    return convertRowPairNeon;
+#endif
+    return convertRowPairC;
+}
 
-    NVENC_API_CALL_RET(ctx->nvenc.nvEncInitializeEncoder(ctx->encoder, &(ctx->reconfigParams.reInitEncodeParams)), 0);
+static void convertABGRToNV12Band(const uint8_t* src, int srcPitch, int width, uint8_t* dstY, int yPitch,
+                                  uint8_t* dstUV, int uvPitch, int startRow, int endRow)
+{
+    static const ConvertRowPair_t convertRowPair = selectConvertKernel();
 
-    if (!encSessionsCount)
-        ctx->isIVS = false;      // streamer
-    else
-        ctx->isIVS = true;
-    encSessionsCount++;
+    for (int y = startRow; y < endRow; y += 2) {
+        convertRowPair(src + y * srcPitch, src + (y + 1) * srcPitch, dstY + y * yPitch, dstY + (y + 1) * yPitch,
+                       dstUV + (y / 2) * uvPitch, width);
+    }
+}
 
-    if (ctx->isIVS) {
-        glGenTextures(1, &ctx->overwriteTex);
-        glBindTexture(GL_TEXTURE_2D, ctx->overwriteTex);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, ctx->width, ctx->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-        glBindTexture(GL_TEXTURE_2D, 0);
+// Band workers shared by all software sessions, started once and signalled per frame
+typedef struct
+{
+    std::mutex                          lock;
+    std::condition_variable             wake;       // jobs queued
+    std::condition_variable             done;       // a job finished
+    std::deque<std::function<void()>>   jobs;
+} AVCConvertPool;
 
-        ctx->overwriteNvencBufInfo = new NvEncBufferInfo;
-        if (!AVCPrepareIOBuffers(ctx, ctx->overwriteNvencBufInfo, ctx->overwriteTex)) {
-            glDeleteTextures(1, &ctx->overwriteTex);
-            ctx->overwriteTex = 0;
-            delete ctx->overwriteNvencBufInfo;
-            ctx->overwriteNvencBufInfo = NULL;
+static void convertPoolWorker(AVCConvertPool* pool)
+{
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> guard(pool->lock);
+            pool->wake.wait(guard, [pool] { return !pool->jobs.empty(); });
+            job = std::move(pool->jobs.front());
+            pool->jobs.pop_front();
         }
+        job();
     }
-    else {
-        ctx->overwriteTex = 0;
-        ctx->overwriteNvencBufInfo = NULL;
-    }
+}
 
-    HDLOGI("AVC encoder created=0x%" PRIx64 " codec=%s width=%d height=%d fps=%d bitrate=%d minBitrate=%d encSessionsCount=%d isIVS=%d\n", (AVCEncCtx)ctx, (codecType==AV1)?"AV1":"H264", width, height, fps, bitrate, ctx->minBitrate, encSessionsCount, ctx->isIVS);
-    return (AVCEncCtx) ctx;
+static AVCConvertPool* convertPoolGet()
+{
+    static std::once_flag once;
+    static AVCConvertPool* pool = NULL;
+
+    // lives for the whole process, the workers are never joined
+    std::call_once(once, [] {
+        pool = new AVCConvertPool();
+        for (int i = 0; i < AVC_SW_CONVERT_THREADS - 1; i++)
+            std::thread(convertPoolWorker, pool).detach();
+    });
+    return pool;
 }
 
-static void RegionOfInterestOpt(int mainRegionValue, int otherRegionValue, bool& centralOptimization) {
-    if (qpData.qpValueOffset == 0 || mainRegionValue == otherRegionValue) {
-        memset(qpData.qpDeltaMapArray, mainRegionValue, qpData.qpDeltaMapArraySize);
+void AVCConvertABGRToNV12(const uint8_t* src, int srcPitch, int width, int height, uint8_t* dstY, int yPitch,
+                          uint8_t* dstUV, int uvPitch, int numThreads)
+{
+    int rowPairs = height / 2;
+    numThreads = std::max(1, std::min(std::min(numThreads, AVC_SW_CONVERT_THREADS), rowPairs));
+    int bandRows = (rowPairs + numThreads - 1) / numThreads * 2;
+
+    if (numThreads == 1) {
+        convertABGRToNV12Band(src, srcPitch, width, dstY, yPitch, dstUV, uvPitch, 0, rowPairs * 2);
         return;
     }
 
-    if (centralOptimization) { // central region optimization
-        for (uint32_t i = 0; i < qpData.heightInMBs; i++) {
-            for (uint32_t j = 0; j < qpData.widthInMBs; j++) {
-                if (( i > qpData.heightInMBs / 4 && i < qpData.heightInMBs * 3 / 4)  && (j > qpData.widthInMBs / 4 && j < qpData.widthInMBs * 3 / 4)) {
-                    qpData.qpDeltaMapArray[i* qpData.widthInMBs + j] = mainRegionValue;
-                } else {
-                    qpData.qpDeltaMapArray[i* qpData.widthInMBs + j] = otherRegionValue;
-                }
-            }
-        }
-        centralOptimization = false;
-    } else { // surrounding region optimization
-        for (uint32_t i = 0; i < qpData.heightInMBs; i++) {
-            for (uint32_t j = 0; j < qpData.widthInMBs; j++) {
-                if ( (i < qpData.heightInMBs / 4 || i > qpData.heightInMBs * 3 / 4 ) || (j < qpData.widthInMBs / 4 || j > qpData.widthInMBs * 3 / 4)) {
-                    qpData.qpDeltaMapArray[i* qpData.widthInMBs + j] = mainRegionValue;
-                } else {
-                    qpData.qpDeltaMapArray[i* qpData.widthInMBs + j] = otherRegionValue;
-                }
-            }
+    // the calling thread converts the first band, the pool the others
+    AVCConvertPool* pool = convertPoolGet();
+    int pending = 0;
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        for (int startRow = bandRows; startRow < rowPairs * 2; startRow += bandRows) {
+            int endRow = std::min(startRow + bandRows, rowPairs * 2);
+            pending++;
+            pool->jobs.push_back([=, &pending] {
+                convertABGRToNV12Band(src, srcPitch, width, dstY, yPitch, dstUV, uvPitch, startRow, endRow);
+                std::lock_guard<std::mutex> jobGuard(pool->lock);
+                if (--pending == 0)
+                    pool->done.notify_all();
+            });
         }
-        centralOptimization = true;
     }
+    pool->wake.notify_all();
 
-    return;
+    convertABGRToNV12Band(src, srcPitch, width, dstY, yPitch, dstUV, uvPitch, 0, std::min(bandRows, rowPairs * 2));
+
+    std::unique_lock<std::mutex> guard(pool->lock);
+    pool->done.wait(guard, [&pending] { return pending == 0; });
 }
 
-static void useQpdeltaStrategy(NvEncBufferInfo* nvencBufInfo, uint32_t bitrate) {
-    if (!nvencBufInfo) {
-        HDLOGE(":::: %s invalid, nvencBufInfo ptr: %p", __FUNCTION__, nvencBufInfo);
-        return;
+void AVCDownscaleABGR2x(const uint8_t* src, int srcPitch, int dstWidth, int dstHeight, uint8_t* dst, int dstPitch)
+{
+    for (int y = 0; y < dstHeight; y++) {
+        const uint8_t* s0 = src + 2 * y * srcPitch;
+        const uint8_t* s1 = s0 + srcPitch;
+        uint8_t* d = dst + y * dstPitch;
+        for (int x = 0; x < dstWidth * 4; x += 4) {
+            for (int c = 0; c < 4; c++)
+                d[x + c] = (s0[2 * x + c] + s0[2 * x + 4 + c] + s1[2 * x + c] + s1[2 * x + 4 + c] + 2) >> 2;
+        }
     }
+}
 
-    static bool centralOptimization = true;
-    bitrateCondition bc;
-    bc = (bitrate > 2000000) ? ( bitrate >= 2500000 ? HIGH_BITRATE : MEDIUM_BITRATE) : LOW_BITRATE;
+// Only the registration is kept per input texture, output buffers are shared
+static NV_ENC_REGISTERED_PTR AVCRegisterInputTexture(AVCEncoderContext* ctx, AVCInputResource* input, GLuint tex, int width, int height)
+{
+    input->resource.texture = tex;
+    input->resource.target = GL_TEXTURE_2D;
+    input->registeredResource = NULL;
 
-    nvencBufInfo->picParams.qpDeltaMapSize = qpData.qpDeltaMapArraySize;
-    switch (bc) {
-        case HIGH_BITRATE:
-            if (dynQpAdjust && dynQpAdjust->dynQpDeltaAdjust_get_mDynQpAdjustReady()){
-                bitrateCondition prevBrtCond = (bitrateCondition)dynQpAdjust->dynQpDeltaAdjust_get_mPrevBrtCondition();
-                qpData.highBitQpValue = dynQpAdjust->qpDeltaOperation(prevBrtCond == bc, qpData.highBitQpValue);
-            }
-            RegionOfInterestOpt(qpData.highBitQpValue, qpData.highBitQpValue*1.2, centralOptimization);
-            nvencBufInfo->picParams.qpDeltaMap = qpData.qpDeltaMapArray;
+    // register input resource
+    NV_ENC_REGISTER_RESOURCE registerResource = { NV_ENC_REGISTER_RESOURCE_VER };
+    registerResource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_OPENGL_TEX;
+    registerResource.width = width;
+    registerResource.height = height;
+    registerResource.pitch = width * 4;
+    registerResource.subResourceIndex = 0;
+    registerResource.resourceToRegister = &input->resource;
+    registerResource.bufferFormat = ctx->format;
+    registerResource.bufferUsage = NV_ENC_INPUT_IMAGE;
+    NVENC_API_CALL_RET(ctx->nvenc.nvEncRegisterResource(ctx->encoder, &registerResource), NULL);
+
+    input->registeredResource = registerResource.registeredResource;
+    return input->registeredResource;
+}
+
+static bool AVCPrepareOutputBuffers(AVCEncoderContext* ctx)
+{
+    ctx->picParams = { NV_ENC_PIC_PARAMS_VER };
+    ctx->picParams.inputWidth = ctx->width;
+    ctx->picParams.inputHeight = ctx->height;
+    ctx->picParams.inputPitch = ctx->width * 4;
+    ctx->picParams.bufferFmt = ctx->format;
+    ctx->picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+
+    // create bitstream buffers for output
+    for (int i = 0; i < AVC_OUTPUT_POOL_DEPTH; i++) {
+        NV_ENC_CREATE_BITSTREAM_BUFFER createBitstreamBuffer = { NV_ENC_CREATE_BITSTREAM_BUFFER_VER };
+        NVENC_API_CALL_RET(ctx->nvenc.nvEncCreateBitstreamBuffer(ctx->encoder, &createBitstreamBuffer), false);
+        ctx->outputPool[i] = createBitstreamBuffer.bitstreamBuffer;
+    }
+    ctx->outputPoolIndex = 0;
+
+    ctx->lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+    ctx->lockBitstreamData.doNotWait = 0;
+
+    return true;
+}
+
+static void AVCDestroyOutputBuffers(AVCEncoderContext* ctx)
+{
+    for (int i = 0; i < AVC_OUTPUT_POOL_DEPTH; i++) {
+        if (ctx->outputPool[i])
+            NVENC_API_CALL(ctx->nvenc.nvEncDestroyBitstreamBuffer(ctx->encoder, ctx->outputPool[i]));
+        ctx->outputPool[i] = NULL;
+    }
+}
+
+// qp delta map has one entry per macroblock of the encoded picture, it is per session as sizes differ
+static void AVCResizeQpDeltaMap(AVCEncoderContext* ctx, int width, int height)
+{
+    ctx->widthInMBs  = ((width + 15) & ~15) >> 4;
+    ctx->heightInMBs = ((height + 15) & ~15) >> 4;
+    ctx->qpDeltaMapArraySize  = ctx->widthInMBs * ctx->heightInMBs;
+    free(ctx->qpDeltaMapArray);
+    ctx->qpDeltaMapArray      = (int8_t*) malloc(ctx->qpDeltaMapArraySize * sizeof(int8_t));
+    memset(ctx->qpDeltaMapArray, 0, ctx->qpDeltaMapArraySize);
+}
+
+// Loads the library on first use, a failed load isn't retried
+static bool nvencLoad(NV_ENCODE_API_FUNCTION_LIST* nvenc)
+{
+    std::lock_guard<std::mutex> guard(nvencLoader.lock);
+    if (!nvencLoader.loadTried) {
+        nvencLoader.loadTried = true;
+
+        void* handle = dlopen("libnvidia-encode.so", RTLD_LAZY);
+        if (!handle) {
+            HDLOGE(":::: %s dlopen libnvidia-encode.so failed error=%s\n", __FUNCTION__, dlerror());
+            return false;
+        }
+
+        NvEncodeAPICreateInstance_t nvEncodeAPICreateInstance = (NvEncodeAPICreateInstance_t) dlsym(handle, "NvEncodeAPICreateInstance");
+        if (!nvEncodeAPICreateInstance) {
+            HDLOGE(":::: %s dlsym NvEncodeAPICreateInstance failed error=%s\n", __FUNCTION__, dlerror());
+            dlclose(handle);
+            return false;
+        }
+
+        nvencLoader.nvenc = { NV_ENCODE_API_FUNCTION_LIST_VER };
+        NVENCSTATUS status = nvEncodeAPICreateInstance(&nvencLoader.nvenc);
+        if (status != NV_ENC_SUCCESS || !nvencLoader.nvenc.nvEncOpenEncodeSessionEx) {
+            HDLOGE(":::: %s EncodeAPI not found error=%d\n", __FUNCTION__, status);
+            dlclose(handle);
+            return false;
+        }
+        nvencLoader.handle = handle;
+    }
+
+    if (!nvencLoader.handle)
+        return false;
+
+    *nvenc = nvencLoader.nvenc;
+    return true;
+}
+
+// nvEncodeAPI.h declares GUID as a plain struct without comparison
+static bool nvencEqualGUID(const GUID& a, const GUID& b)
+{
+    return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+// Low latency presets in order of preference, sessions use the first one the GPU lists for the codec
+static const GUID* nvencPresetPreference[] = { &NV_ENC_PRESET_P2_GUID, &NV_ENC_PRESET_P1_GUID, &NV_ENC_PRESET_P3_GUID, &NV_ENC_PRESET_P4_GUID };
+
+// Returns false when the preset list can't be queried, *found tells if a preferred preset is supported
+static bool nvencSelectPreset(AVCEncoderContext* ctx, GUID codecGUID, GUID* preset, bool* found)
+{
+    *found = false;
+    uint32_t count = 0;
+    NVENC_API_CALL_RET(ctx->nvenc.nvEncGetEncodePresetCount(ctx->encoder, codecGUID, &count), false);
+    std::vector<GUID> presets(count);
+    if (count)
+        NVENC_API_CALL_RET(ctx->nvenc.nvEncGetEncodePresetGUIDs(ctx->encoder, codecGUID, presets.data(), count, &count), false);
+    presets.resize(count);
+    for (const GUID* wanted : nvencPresetPreference) {
+        for (const GUID& supported : presets) {
+            if (nvencEqualGUID(supported, *wanted)) {
+                *preset = supported;
+                *found = true;
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+// Clears *ok when the query fails, so a series of queries can be checked once
+static int nvencGetCap(AVCEncoderContext* ctx, GUID codecGUID, NV_ENC_CAPS cap, bool* ok)
+{
+    NV_ENC_CAPS_PARAM capsParam = { NV_ENC_CAPS_PARAM_VER };
+    capsParam.capsToQuery = cap;
+    int value = 0;
+    NVENCSTATUS status = ctx->nvenc.nvEncGetEncodeCaps(ctx->encoder, codecGUID, &capsParam, &value);
+    if (status != NV_ENC_SUCCESS) {
+        HDLOGE(":::: %s: cap=%d returned error=%d\n", __FUNCTION__, cap, status);
+        *ok = false;
+        return 0;
+    }
+    return value;
+}
+
+// Queries the capabilities through the first open session, later sessions get the cached result.
+// A failed probe is not cached, the next session probes again.
+static bool nvencProbeCaps(AVCEncoderContext* ctx, AVCEncoderCaps* caps)
+{
+    std::lock_guard<std::mutex> guard(nvencLoader.lock);
+    if (nvencLoader.capsProbed) {
+        *caps = nvencLoader.caps;
+        return true;
+    }
+
+    AVCEncoderCaps probed = {};
+    bool ok = true;
+    uint32_t count = 0;
+    NVENC_API_CALL_RET(ctx->nvenc.nvEncGetEncodeGUIDCount(ctx->encoder, &count), false);
+    std::vector<GUID> guids(count);
+    if (count)
+        NVENC_API_CALL_RET(ctx->nvenc.nvEncGetEncodeGUIDs(ctx->encoder, guids.data(), count, &count), false);
+    guids.resize(count);
+    for (const GUID& guid : guids) {
+        probed.h264 |= nvencEqualGUID(guid, H264_ENCODE_GUID);
+        probed.av1 |= nvencEqualGUID(guid, AV1_ENCODE_GUID);
+    }
+
+    if (probed.h264) {
+        GUID preset;
+        if (!nvencSelectPreset(ctx, H264_ENCODE_GUID, &preset, &probed.lowLatencyPreset))
+            return false;
+
+        probed.qpDeltaMap = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_SUPPORT_CABAC, &ok) != 0;
+        probed.temporalSvc = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_SUPPORT_TEMPORAL_SVC, &ok) != 0;
+        probed.maxTemporalLayers = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_NUM_MAX_TEMPORAL_LAYERS, &ok);
+        probed.maxLtrFrames = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_NUM_MAX_LTR_FRAMES, &ok);
+        probed.asyncEncode = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_ASYNC_ENCODE_SUPPORT, &ok) != 0;
+        probed.subframeReadback = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_SUPPORT_SUBFRAME_READBACK, &ok) != 0;
+        probed.dynamicResolution = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_SUPPORT_DYN_RES_CHANGE, &ok) != 0;
+        probed.maxWidth = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_WIDTH_MAX, &ok);
+        probed.maxHeight = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_HEIGHT_MAX, &ok);
+        probed.maxMBPerSec = nvencGetCap(ctx, H264_ENCODE_GUID, NV_ENC_CAPS_MB_PER_SEC_MAX, &ok);
+    }
+    if (!ok)
+        return false;
+
+    HDLOGI("%s: h264=%d av1=%d lowLatencyPreset=%d qpDeltaMap=%d temporalSvc=%d maxTemporalLayers=%d maxLtrFrames=%d async=%d subframe=%d dynamicResolution=%d max=%dx%d maxMBPerSec=%" PRIu64 "\n", __FUNCTION__, probed.h264, probed.av1, probed.lowLatencyPreset, probed.qpDeltaMap, probed.temporalSvc, probed.maxTemporalLayers, probed.maxLtrFrames, probed.asyncEncode, probed.subframeReadback, probed.dynamicResolution, probed.maxWidth, probed.maxHeight, probed.maxMBPerSec);
+
+    nvencLoader.caps = probed;
+    nvencLoader.capsProbed = true;
+    *caps = probed;
+    return true;
+}
+
+bool AVCGetEncoderCaps(AVCEncoderCaps* caps)
+{
+    std::lock_guard<std::mutex> guard(nvencLoader.lock);
+    if (!nvencLoader.capsProbed)
+        return false;
+
+    *caps = nvencLoader.caps;
+    return true;
+}
+
+static void AVCReleaseQpState()
+{
+    qpData.isQpEnabled = false;
+    if (dynQpAdjust) {
+        delete dynQpAdjust;
+        dynQpAdjust = NULL;
+    }
+}
+
+static bool AVCInitNvEncoder(AVCEncoderContext* ctx, Codec codecType, int width, int height, int fps, int bitrate)
+{
+    ctx->bitrate = bitrate;
+    ctx->minBitrate = bitrate / 2.5;
+    ctx->format = NV_ENC_BUFFER_FORMAT_ABGR;
+
+    if (!setupEGLResources(ctx, width, height))
+        return false;
+
+    if (!nvencLoad(&ctx->nvenc))
+        return false;
+
+    NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS encodeSessionExParams = { NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER };
+    encodeSessionExParams.device = NULL;
+    encodeSessionExParams.deviceType = NV_ENC_DEVICE_TYPE_OPENGL;
+    encodeSessionExParams.apiVersion = NVENCAPI_VERSION;
+    ctx->encoder = NULL;
+    NVENC_API_CALL_RET(ctx->nvenc.nvEncOpenEncodeSessionEx(&encodeSessionExParams, &ctx->encoder), false);
+
+    AVCEncoderCaps caps;
+    if (!nvencProbeCaps(ctx, &caps)) {
+        HDLOGE(":::: %s capability probe failed\n", __FUNCTION__);
+        return false;
+    }
+    if ((codecType == H264 && !caps.h264) || (codecType == AV1 && !caps.av1)) {
+        HDLOGE(":::: %s codecType=%d not supported\n", __FUNCTION__, codecType);
+        return false;
+    }
+    GUID presetGUID;
+    bool presetFound;
+    if (!nvencSelectPreset(ctx, (codecType == AV1) ? AV1_ENCODE_GUID : H264_ENCODE_GUID, &presetGUID, &presetFound))
+        return false;
+    if (!presetFound) {
+        HDLOGE(":::: %s codecType=%d no low latency preset supported\n", __FUNCTION__, codecType);
+        return false;
+    }
+    if (codecType == H264 && (width > caps.maxWidth || height > caps.maxHeight)) {
+        HDLOGE(":::: %s %dx%d exceeds max %dx%d\n", __FUNCTION__, width, height, caps.maxWidth, caps.maxHeight);
+        return false;
+    }
+
+    ctx->reconfigParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    ctx->reconfigParams.reInitEncodeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+    ctx->reconfigParams.reInitEncodeParams.presetGUID = presetGUID;
+    ctx->reconfigParams.reInitEncodeParams.encodeWidth = width;
+    ctx->reconfigParams.reInitEncodeParams.encodeHeight = height;
+    ctx->reconfigParams.reInitEncodeParams.darWidth = width;
+    ctx->reconfigParams.reInitEncodeParams.darHeight = height;
+    ctx->reconfigParams.reInitEncodeParams.frameRateNum = fps;
+    ctx->reconfigParams.reInitEncodeParams.frameRateDen = 1;
+    ctx->reconfigParams.reInitEncodeParams.enableEncodeAsync = 0;
+    ctx->reconfigParams.reInitEncodeParams.enablePTD = 1;
+    ctx->reconfigParams.reInitEncodeParams.reportSliceOffsets = 0;
+    ctx->reconfigParams.reInitEncodeParams.enableSubFrameWrite = 0;
+    ctx->reconfigParams.reInitEncodeParams.enableMEOnlyMode = 0;
+    ctx->reconfigParams.reInitEncodeParams.enableOutputInVidmem = 0;
+
+    NV_ENC_PRESET_CONFIG presetConfig = { NV_ENC_PRESET_CONFIG_VER, { NV_ENC_CONFIG_VER } };
+    ctx->reconfigParams.reInitEncodeParams.encodeConfig = new NV_ENC_CONFIG;
+
+    switch (codecType) {
+        case AV1:
+            qpData.isQpEnabled = false;     // don't use qp for av1 codec
+            ctx->reconfigParams.reInitEncodeParams.encodeGUID = AV1_ENCODE_GUID;
+            NVENC_API_CALL_RET(ctx->nvenc.nvEncGetEncodePresetConfigEx(ctx->encoder, AV1_ENCODE_GUID, presetGUID, AVC_TUNING_INFO, &presetConfig), false);
+            memcpy(ctx->reconfigParams.reInitEncodeParams.encodeConfig, &(presetConfig.presetCfg), sizeof(NV_ENC_CONFIG));
+
+            ctx->reconfigParams.reInitEncodeParams.encodeConfig->profileGUID = NV_ENC_AV1_PROFILE_MAIN_GUID;
+            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.av1Config.level = NV_ENC_LEVEL_AV1_AUTOSELECT;
+            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.av1Config.useBFramesAsRef = NV_ENC_BFRAME_REF_MODE_DISABLED;
+            if (ctx->temporalLayers > 1 || ctx->ltrFrames) {
+                HDLOGI("%s: temporal SVC and LTR are only supported for H264, disabled\n", __FUNCTION__);
+                ctx->temporalLayers = 0;
+                ctx->ltrFrames = 0;
+            }
+            break;
+
+        case H264:
+            ctx->reconfigParams.reInitEncodeParams.encodeGUID = H264_ENCODE_GUID;
+            NVENC_API_CALL_RET(ctx->nvenc.nvEncGetEncodePresetConfigEx(ctx->encoder, H264_ENCODE_GUID, presetGUID, AVC_TUNING_INFO, &presetConfig), false);
+            memcpy(ctx->reconfigParams.reInitEncodeParams.encodeConfig, &(presetConfig.presetCfg), sizeof(NV_ENC_CONFIG));
+
+            ctx->reconfigParams.reInitEncodeParams.encodeConfig->profileGUID = NV_ENC_H264_PROFILE_BASELINE_GUID;
+            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.level = NV_ENC_LEVEL_AUTOSELECT;
+            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+            ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.disableSPSPPS = 0;
+            if (ctx->temporalLayers > 1 && (!caps.temporalSvc || caps.maxTemporalLayers < 2)) {
+                HDLOGI("%s: temporal SVC not supported by the encoder, disabled\n", __FUNCTION__);
+                ctx->temporalLayers = 0;
+            }
+            ctx->temporalLayers = std::min(ctx->temporalLayers, caps.maxTemporalLayers);
+            if (ctx->ltrFrames && (ctx->temporalLayers > 1 || caps.maxLtrFrames < 1)) {
+                HDLOGI("%s: LTR not supported by the encoder or with temporal SVC, disabled\n", __FUNCTION__);
+                ctx->ltrFrames = 0;
+            }
+            ctx->ltrFrames = std::min(ctx->ltrFrames, caps.maxLtrFrames);
+            if (ctx->ltrFrames) {
+                ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableLTR = 1;
+                ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.ltrNumFrames = ctx->ltrFrames;
+                ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.ltrTrustMode = 0;   // marked per picture
+            }
+            if (ctx->temporalLayers > 1) {
+                ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableTemporalSVC = 1;
+                ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.numTemporalLayers = ctx->temporalLayers;
+                ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.maxTemporalLayers = ctx->temporalLayers;
+                ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableScalabilityInfoSEI = 1;
+            }
+            break;
+
+        default:
+            HDLOGE(":::: Invalid codecType=%d\n", codecType);
+            return false;
+    }
+
+    ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.averageBitRate = bitrate;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.maxBitRate = bitrate;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.idrPeriod = 60;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.enableAQ = 1;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.enableTemporalAQ = 1;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->gopLength = 30;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.enableLookahead = 1;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.disableIadapt = 0;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.disableBadapt = 1;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->frameIntervalP = 1;
+    ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableConstrainedEncoding = 1;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.enableIntraRefresh = 1;
+    //ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.intraRefreshPeriod = 30;
+
+    if (qpData.isQpEnabled && !caps.qpDeltaMap) {
+        HDLOGI("%s: CABAC not supported by the encoder, QP disabled\n", __FUNCTION__);
+        qpData.isQpEnabled = false;
+    }
+
+    if (qpData.isQpEnabled) {
+        ctx->usesQp = true;
+
+        if (qpData.isDynamicMode()) {
+            dynQpAdjust = new dynQpDeltaAdjustMsg(ctx);
+            HDLOGI("%s: Dynamic Qpdelta adjustment algorithm take effect\n", __FUNCTION__);
+        }
+        ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.rateControlMode = NV_ENC_PARAMS_RC_CONSTQP;
+        HDLOGI("%s: QP is enabled, lowBitQpValue=%d, mediumBitQpValue=%d, highBitQpValue=%d, qpValueOffset=%d\n", __FUNCTION__, qpData.lowBitQpValue, qpData.mediumBitQpValue, qpData.highBitQpValue, qpData.qpValueOffset);
+
+        ctx->reconfigParams.reInitEncodeParams.encodeConfig->profileGUID = NV_ENC_H264_PROFILE_MAIN_GUID;
+        ctx->reconfigParams.reInitEncodeParams.encodeConfig->encodeCodecConfig.h264Config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CABAC;
+        ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+
+        AVCResizeQpDeltaMap(ctx, width, height);
+    }
+    else {
+        HDLOGI("%s: QP is disabled\n", __FUNCTION__);
+    }
+
+    ctx->reconfigParams.reInitEncodeParams.maxEncodeWidth = width;
+    ctx->reconfigParams.reInitEncodeParams.maxEncodeHeight = height;
+    ctx->reconfigParams.reInitEncodeParams.tuningInfo = AVC_TUNING_INFO;
+
+    NVENC_API_CALL_RET(ctx->nvenc.nvEncInitializeEncoder(ctx->encoder, &(ctx->reconfigParams.reInitEncodeParams)), false);
+
+    if (!AVCPrepareOutputBuffers(ctx))
+        return false;
+
+    if (ctx->isIVS) {
+        glGenTextures(1, &ctx->overwriteTex);
+        glBindTexture(GL_TEXTURE_2D, ctx->overwriteTex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, ctx->width, ctx->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        if (!AVCRegisterInputTexture(ctx, &ctx->overwriteInput, ctx->overwriteTex, ctx->width, ctx->height)) {
+            glDeleteTextures(1, &ctx->overwriteTex);
+            ctx->overwriteTex = 0;
+        }
+    }
+    else {
+        ctx->overwriteTex = 0;
+        ctx->overwriteInput.registeredResource = NULL;
+    }
+
+    return true;
+}
+
+static void RegionOfInterestOpt(AVCEncoderContext* ctx, int mainRegionValue, int otherRegionValue, bool& centralOptimization) {
+    if (qpData.qpValueOffset == 0 || mainRegionValue == otherRegionValue) {
+        memset(ctx->qpDeltaMapArray, mainRegionValue, ctx->qpDeltaMapArraySize);
+        return;
+    }
+
+    if (centralOptimization) { // central region optimization
+        for (uint32_t i = 0; i < ctx->heightInMBs; i++) {
+            for (uint32_t j = 0; j < ctx->widthInMBs; j++) {
+                if (( i > ctx->heightInMBs / 4 && i < ctx->heightInMBs * 3 / 4)  && (j > ctx->widthInMBs / 4 && j < ctx->widthInMBs * 3 / 4)) {
+                    ctx->qpDeltaMapArray[i* ctx->widthInMBs + j] = mainRegionValue;
+                } else {
+                    ctx->qpDeltaMapArray[i* ctx->widthInMBs + j] = otherRegionValue;
+                }
+            }
+        }
+        centralOptimization = false;
+    } else { // surrounding region optimization
+        for (uint32_t i = 0; i < ctx->heightInMBs; i++) {
+            for (uint32_t j = 0; j < ctx->widthInMBs; j++) {
+                if ( (i < ctx->heightInMBs / 4 || i > ctx->heightInMBs * 3 / 4 ) || (j < ctx->widthInMBs / 4 || j > ctx->widthInMBs * 3 / 4)) {
+                    ctx->qpDeltaMapArray[i* ctx->widthInMBs + j] = mainRegionValue;
+                } else {
+                    ctx->qpDeltaMapArray[i* ctx->widthInMBs + j] = otherRegionValue;
+                }
+            }
+        }
+        centralOptimization = true;
+    }
+
+    return;
+}
+
+// Uniform dynamic qp value plus the rasterized ROI hints, replaces the geometric guess of RegionOfInterestOpt
+static void RoiHintOpt(AVCEncoderContext* ctx, const int8_t* roiMap, int baseValue) {
+    for (uint32_t i = 0; i < ctx->qpDeltaMapArraySize; i++)
+        ctx->qpDeltaMapArray[i] = std::max(-51, std::min(51, baseValue + roiMap[i]));
+}
+
+static void useQpdeltaStrategy(AVCEncoderContext* ctx, NV_ENC_PIC_PARAMS* picParams, uint32_t bitrate, const int8_t* roiMap) {
+    if (!picParams) {
+        HDLOGE(":::: %s invalid, picParams ptr: %p", __FUNCTION__, picParams);
+        return;
+    }
+
+    static bool centralOptimization = true;
+    bitrateCondition bc;
+    bc = (bitrate > 2000000) ? ( bitrate >= 2500000 ? HIGH_BITRATE : MEDIUM_BITRATE) : LOW_BITRATE;
+
+    picParams->qpDeltaMapSize = ctx->qpDeltaMapArraySize;
+    switch (bc) {
+        case HIGH_BITRATE:
+            if (dynQpAdjust && dynQpAdjust->dynQpDeltaAdjust_get_mDynQpAdjustReady()){
+                bitrateCondition prevBrtCond = (bitrateCondition)dynQpAdjust->dynQpDeltaAdjust_get_mPrevBrtCondition();
+                qpData.highBitQpValue = dynQpAdjust->qpDeltaOperation(prevBrtCond == bc, qpData.highBitQpValue);
+            }
+            if (roiMap)
+                RoiHintOpt(ctx, roiMap, qpData.highBitQpValue);
+            else
+                RegionOfInterestOpt(ctx, qpData.highBitQpValue, qpData.highBitQpValue*1.2, centralOptimization);
+            picParams->qpDeltaMap = ctx->qpDeltaMapArray;
             break;
         case MEDIUM_BITRATE:
             if (dynQpAdjust && dynQpAdjust->dynQpDeltaAdjust_get_mDynQpAdjustReady()){
                 bitrateCondition prevBrtCond = (bitrateCondition)dynQpAdjust->dynQpDeltaAdjust_get_mPrevBrtCondition();
                 qpData.mediumBitQpValue = dynQpAdjust->qpDeltaOperation(prevBrtCond == bc, qpData.mediumBitQpValue);
             }
-            RegionOfInterestOpt(qpData.mediumBitQpValue - qpData.qpValueOffset , qpData.mediumBitQpValue + qpData.qpValueOffset, centralOptimization);
-            nvencBufInfo->picParams.qpDeltaMap  = qpData.qpDeltaMapArray;
+            if (roiMap)
+                RoiHintOpt(ctx, roiMap, qpData.mediumBitQpValue);
+            else
+                RegionOfInterestOpt(ctx, qpData.mediumBitQpValue - qpData.qpValueOffset , qpData.mediumBitQpValue + qpData.qpValueOffset, centralOptimization);
+            picParams->qpDeltaMap  = ctx->qpDeltaMapArray;
             break;
         case LOW_BITRATE:
             if (dynQpAdjust && dynQpAdjust->dynQpDeltaAdjust_get_mDynQpAdjustReady()){
                 bitrateCondition prevBrtCond = (bitrateCondition)dynQpAdjust->dynQpDeltaAdjust_get_mPrevBrtCondition();
                 qpData.lowBitQpValue = dynQpAdjust->qpDeltaOperation(prevBrtCond == bc, qpData.lowBitQpValue);
             }
-            RegionOfInterestOpt(qpData.lowBitQpValue - qpData.qpValueOffset, qpData.lowBitQpValue + qpData.qpValueOffset, centralOptimization);
-            nvencBufInfo->picParams.qpDeltaMap  = qpData.qpDeltaMapArray;
-            break;
-        default:
-            HDLOGE(":::: %s invalid qpdelta mode setting!!!", __FUNCTION__);
-            break;
+            if (roiMap)
+                RoiHintOpt(ctx, roiMap, qpData.lowBitQpValue);
+            else
+                RegionOfInterestOpt(ctx, qpData.lowBitQpValue - qpData.qpValueOffset, qpData.lowBitQpValue + qpData.qpValueOffset, centralOptimization);
+            picParams->qpDeltaMap  = ctx->qpDeltaMapArray;
+            break;
+        default:
+            HDLOGE(":::: %s invalid qpdelta mode setting!!!", __FUNCTION__);
+            break;
+    }
+
+    if (dynQpAdjust && dynQpAdjust->dynQpDeltaAdjust_get_mDynQpAdjustReady()) {
+        dynQpAdjust->dynQpDeltaAdjust_set_mPrevBrtCondition((int)bc);
+        dynQpAdjust->dynQpDeltaAdjust_set_mDynQpAdjustReady(false);
+    }
+    return;
+}
+
+// Reconfigures the encoder to a step of the resolution ladder, maxEncodeWidth/Height stay at the input size
+static bool AVCApplyEncodeScale(AVCEncoderContext* ctx, int step)
+{
+    int width = (ctx->width * scaleLadderPercent[step] / 100) & ~1;
+    int height = (ctx->height * scaleLadderPercent[step] / 100) & ~1;
+    int prevWidth = ctx->encodeWidth;
+    int prevHeight = ctx->encodeHeight;
+
+    {
+        // the pixel rate freed by a step down may have been admitted to other sessions since
+        std::lock_guard<std::mutex> guard(sessionManager.lock);
+        if (step < ctx->scaleStep && sessionManager.maxPixelRate) {
+            uint64_t rate = sessionTotalPixelRateLocked() - sessionPixelRate(ctx, ctx->decimation) +
+                            (uint64_t)width * height * ctx->fps / ctx->decimation;
+            if (rate > sessionManager.maxPixelRate) {
+                HDLOGI("%s: encoder=0x%" PRIx64 " stays at %dx%d, pixel rate budget exhausted (%" PRIu64 "/%" PRIu64 ")\n", __FUNCTION__, (AVCEncCtx)ctx, prevWidth, prevHeight, rate, sessionManager.maxPixelRate);
+                return false;
+            }
+        }
+        // reserved before the reconfigure so that admissions see it
+        ctx->encodeWidth = width;
+        ctx->encodeHeight = height;
+    }
+
+    ctx->reconfigParams.reInitEncodeParams.encodeWidth = width;
+    ctx->reconfigParams.reInitEncodeParams.encodeHeight = height;
+    ctx->reconfigParams.reInitEncodeParams.darWidth = width;
+    ctx->reconfigParams.reInitEncodeParams.darHeight = height;
+    ctx->reconfigParams.resetEncoder = 1;
+    ctx->reconfigParams.forceIDR = 1;
+    NVENCSTATUS status = ctx->nvenc.nvEncReconfigureEncoder(ctx->encoder, &(ctx->reconfigParams));
+    ctx->reconfigParams.resetEncoder = 0;
+    ctx->reconfigParams.forceIDR = 0;
+    if (status != NV_ENC_SUCCESS) {
+        HDLOGE(":::: %s: resolution change to %dx%d returned error=%d, adaptive resolution disabled\n", __FUNCTION__, width, height, status);
+        ctx->reconfigParams.reInitEncodeParams.encodeWidth = prevWidth;
+        ctx->reconfigParams.reInitEncodeParams.encodeHeight = prevHeight;
+        ctx->reconfigParams.reInitEncodeParams.darWidth = prevWidth;
+        ctx->reconfigParams.reInitEncodeParams.darHeight = prevHeight;
+        ctx->adaptiveResolution = false;
+
+        std::lock_guard<std::mutex> guard(sessionManager.lock);
+        ctx->encodeWidth = prevWidth;
+        ctx->encodeHeight = prevHeight;
+        return false;
+    }
+
+    ctx->picParams.inputWidth = width;
+    ctx->picParams.inputHeight = height;
+    ctx->picParams.inputPitch = width * 4;
+    if (ctx->usesQp)
+        AVCResizeQpDeltaMap(ctx, width, height);
+
+    ctx->scaleStep = step;
+    HDLOGI("%s: encoder=0x%" PRIx64 " encodes at %dx%d (%d%%)\n", __FUNCTION__, (AVCEncCtx)ctx, width, height, scaleLadderPercent[step]);
+    return true;
+}
+
+// Walks the resolution ladder on the average bitrate per pixel, steps up need a margin to avoid flapping
+static void AVCUpdateEncodeScale(AVCEncoderContext* ctx, uint32_t bitrate)
+{
+    ctx->scaleBitrateSum += bitrate;
+    ctx->scaleFrames++;
+    if (sessionElapsedMs(ctx->scaleCheckTime) < AVC_SCALE_CHECK_INTERVAL_MS)
+        return;
+
+    uint64_t avgBitrate = ctx->scaleBitrateSum / ctx->scaleFrames;
+    ctx->scaleBitrateSum = 0;
+    ctx->scaleFrames = 0;
+    gettimeofday(&ctx->scaleCheckTime, NULL);
+
+    int step = ctx->scaleStep;
+    int fps = std::max(1, ctx->fps / ctx->decimation);
+    float bpp = (float)avgBitrate / ((float)ctx->encodeWidth * ctx->encodeHeight * fps);
+
+    if (bpp < AVC_SCALE_DOWN_BPP && step + 1 < AVC_SCALE_STEPS)
+        ctx->scaleDownChecks++;
+    else
+        ctx->scaleDownChecks = 0;
+
+    if (step > 0) {
+        float percent = scaleLadderPercent[step - 1] / 100.0f;
+        float upBpp = (float)avgBitrate / (ctx->width * percent * ctx->height * percent * fps);
+        if (upBpp >= AVC_SCALE_UP_BPP)
+            ctx->scaleUpChecks++;
+        else
+            ctx->scaleUpChecks = 0;
+    }
+
+    if (ctx->scaleDownChecks >= AVC_SCALE_DOWN_CHECKS)
+        step++;
+    else if (ctx->scaleUpChecks >= AVC_SCALE_UP_CHECKS)
+        step--;
+    else
+        return;
+
+    ctx->scaleDownChecks = 0;
+    ctx->scaleUpChecks = 0;
+    AVCApplyEncodeScale(ctx, step);
+}
+
+// Scales srcTex into dstTex, dstTex stays attached to blitFbo[1]
+static void AVCBlitTexture(AVCEncoderContext* ctx, GLuint srcTex, int srcWidth, int srcHeight, GLuint dstTex, int dstWidth, int dstHeight)
+{
+    if (!ctx->blitFbo[0])
+        glGenFramebuffers(2, ctx->blitFbo);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->blitFbo[0]);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, srcTex, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->blitFbo[1]);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, dstTex, 0);
+    glBlitFramebuffer(0, 0, srcWidth, srcHeight, 0, 0, dstWidth, dstHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+}
+
+// Blits the input into the texture of the current ladder step, textures are created and registered on first use
+static NV_ENC_REGISTERED_PTR AVCScaleInput(AVCEncoderContext* ctx, GLuint srcTex)
+{
+    int step = ctx->scaleStep;
+
+    if (!ctx->scaledTex[step]) {
+        glGenTextures(1, &ctx->scaledTex[step]);
+        glBindTexture(GL_TEXTURE_2D, ctx->scaledTex[step]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, ctx->encodeWidth, ctx->encodeHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        if (!AVCRegisterInputTexture(ctx, &ctx->scaledInput[step], ctx->scaledTex[step], ctx->encodeWidth, ctx->encodeHeight)) {
+            glDeleteTextures(1, &ctx->scaledTex[step]);
+            ctx->scaledTex[step] = 0;
+            return NULL;
+        }
+    }
+
+    AVCBlitTexture(ctx, srcTex, ctx->width, ctx->height, ctx->scaledTex[step], ctx->encodeWidth, ctx->encodeHeight);
+    return ctx->scaledInput[step].registeredResource;
+}
+
+static uint32_t AVCThumbSad(const uint8_t* a, const uint8_t* b)
+{
+    uint32_t sad = 0;
+    for (int i = 0; i < AVC_LTR_THUMB_BYTES; i += 4) {
+        for (int c = 0; c < 3; c++)
+            sad += abs(a[i + c] - b[i + c]);
+    }
+    return sad;
+}
+
+static GLuint AVCCreateTexture(int width, int height)
+{
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return tex;
+}
+
+// Box filters srcTex down to the signature size and reads it back through a PBO. To not stall the
+// render thread ltrPrevThumb gets the signature of the previous call, returns false while there is none.
+// With readCurrent ltrThumb also gets the signature of srcTex, that readback waits for the blits.
+static bool AVCLtrThumbnail(AVCEncoderContext* ctx, GLuint srcTex, bool readCurrent)
+{
+    if (!ctx->ltrThumbTex) {
+        // a bilinear blit to exactly half size averages 2x2 texels, so halving steps build a box filter
+        int width = ctx->width;
+        int height = ctx->height;
+        while ((width > 2 * AVC_LTR_THUMB_SIZE || height > 2 * AVC_LTR_THUMB_SIZE) && ctx->ltrLevels < AVC_LTR_THUMB_LEVELS) {
+            width = std::max(AVC_LTR_THUMB_SIZE, (width + 1) / 2);
+            height = std::max(AVC_LTR_THUMB_SIZE, (height + 1) / 2);
+            ctx->ltrLevelTex[ctx->ltrLevels] = AVCCreateTexture(width, height);
+            ctx->ltrLevelWidth[ctx->ltrLevels] = width;
+            ctx->ltrLevelHeight[ctx->ltrLevels] = height;
+            ctx->ltrLevels++;
+        }
+        ctx->ltrThumbTex = AVCCreateTexture(AVC_LTR_THUMB_SIZE, AVC_LTR_THUMB_SIZE);
+
+        glGenBuffers(2, ctx->ltrPbo);
+        for (int i = 0; i < 2; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->ltrPbo[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, AVC_LTR_THUMB_BYTES, NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    GLuint tex = srcTex;
+    int width = ctx->width;
+    int height = ctx->height;
+    for (int i = 0; i < ctx->ltrLevels; i++) {
+        AVCBlitTexture(ctx, tex, width, height, ctx->ltrLevelTex[i], ctx->ltrLevelWidth[i], ctx->ltrLevelHeight[i]);
+        tex = ctx->ltrLevelTex[i];
+        width = ctx->ltrLevelWidth[i];
+        height = ctx->ltrLevelHeight[i];
+    }
+    AVCBlitTexture(ctx, tex, width, height, ctx->ltrThumbTex, AVC_LTR_THUMB_SIZE, AVC_LTR_THUMB_SIZE);
+
+    // read this frame now if asked, queue its PBO readback, then map the one queued by the previous call
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->blitFbo[1]);
+    ctx->ltrHaveThumb = readCurrent;
+    if (readCurrent)
+        glReadPixels(0, 0, AVC_LTR_THUMB_SIZE, AVC_LTR_THUMB_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, ctx->ltrThumb);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->ltrPbo[ctx->ltrReadbacks & 1]);
+    glReadPixels(0, 0, AVC_LTR_THUMB_SIZE, AVC_LTR_THUMB_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+    bool ready = false;
+    if (ctx->ltrReadbacks > 0) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->ltrPbo[(ctx->ltrReadbacks - 1) & 1]);
+        void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, AVC_LTR_THUMB_BYTES, GL_MAP_READ_BIT);
+        if (data) {
+            memcpy(ctx->ltrPrevThumb, data, AVC_LTR_THUMB_BYTES);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            ready = true;
+        }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    ctx->ltrReadbacks++;
+    return ready;
+}
+
+static void AVCLtrClear(AVCEncoderContext* ctx)
+{
+    for (int i = 0; i < ctx->ltrFrames; i++)
+        ctx->ltrSlots[i].valid = false;
+    ctx->ltrLastMarked = -1;
+    // the scene has to stay stable again before it is marked into the emptied slots
+    ctx->ltrSceneMarked = false;
+    ctx->ltrStableFrames = 0;
+}
+
+// Stores the LTR marked by an encoded frame, slots only change once the encoder holds the reference
+static void AVCLtrCommit(AVCEncoderContext* ctx, const AVCEncodedFrame* frame)
+{
+    if (!frame->ltrMarked)
+        return;
+
+    int idx = frame->ltrIdx;
+    ctx->ltrSlots[idx].valid = true;
+    memcpy(ctx->ltrSlots[idx].thumb, ctx->ltrThumb, AVC_LTR_THUMB_BYTES);
+    ctx->ltrLastMarked = idx;
+    ctx->ltrSceneMarked = true;
+    if (idx == ctx->ltrNextSlot)
+        ctx->ltrNextSlot = (ctx->ltrNextSlot + 1) % ctx->ltrFrames;
+}
+
+// Sets the LTR controls of the next frame. A scene that stayed for AVC_LTR_STABLE_FRAMES is marked,
+// a flip back to a marked scene or a recovery request only references that LTR. Using an LTR has to
+// be decided on this frame, so while a slot is valid its signature is read back right away. Stable
+// scenes are tracked one frame behind on the PBO signatures, which don't stall the render thread.
+static void AVCLtrPrepare(AVCEncoderContext* ctx, GLuint srcTex, bool recovery, AVCEncodedFrame* frame)
+{
+    NV_ENC_PIC_PARAMS_H264* h264PicParams = &ctx->picParams.codecPicParams.h264PicParams;
+    h264PicParams->ltrMarkFrame = 0;
+    h264PicParams->ltrMarkFrameIdx = 0;
+    h264PicParams->ltrUseFrames = 0;
+    h264PicParams->ltrUseFrameBitmap = 0;
+
+    bool slotValid = false;
+    for (int i = 0; i < ctx->ltrFrames; i++)
+        slotValid |= ctx->ltrSlots[i].valid;
+    // a frame that may get marked needs its own signature too, it is stored with the slot
+    bool markDue = !ctx->ltrSceneMarked && ctx->ltrStableFrames + 1 >= AVC_LTR_STABLE_FRAMES;
+    bool havePrev = AVCLtrThumbnail(ctx, srcTex, slotValid || markDue);
+
+    bool sceneChange = false;
+    int match = -1;
+    if (ctx->ltrHaveThumb) {
+        sceneChange = havePrev && AVCThumbSad(ctx->ltrThumb, ctx->ltrPrevThumb) > AVC_LTR_SCENE_SAD;
+
+        uint32_t bestSad = AVC_LTR_MATCH_SAD;
+        for (int i = 0; i < ctx->ltrFrames; i++) {
+            if (!ctx->ltrSlots[i].valid)
+                continue;
+            uint32_t sad = AVCThumbSad(ctx->ltrThumb, ctx->ltrSlots[i].thumb);
+            if (sad < bestSad) {
+                bestSad = sad;
+                match = i;
+            }
+        }
     }
 
-    if (dynQpAdjust && dynQpAdjust->dynQpDeltaAdjust_get_mDynQpAdjustReady()) {
-        dynQpAdjust->dynQpDeltaAdjust_set_mPrevBrtCondition((int)bc);
-        dynQpAdjust->dynQpDeltaAdjust_set_mDynQpAdjustReady(false);
+    int useIdx = -1;
+    if (recovery)
+        useIdx = ctx->ltrLastMarked;
+    else if (sceneChange)
+        useIdx = match;
+    if (useIdx >= 0) {
+        h264PicParams->ltrUseFrames = 1;
+        h264PicParams->ltrUseFrameBitmap = 1 << useIdx;
+        frame->ltrUsed = true;
+        frame->ltrIdx = useIdx;
+    }
+
+    if (havePrev) {
+        if (ctx->ltrHaveOlder && AVCThumbSad(ctx->ltrPrevThumb, ctx->ltrOlderThumb) > AVC_LTR_SCENE_SAD) {
+            ctx->ltrStableFrames = 0;
+            ctx->ltrSceneMarked = false;
+        }
+        else
+            ctx->ltrStableFrames++;
+        memcpy(ctx->ltrOlderThumb, ctx->ltrPrevThumb, AVC_LTR_THUMB_BYTES);
+        ctx->ltrHaveOlder = true;
+    }
+
+    if (ctx->ltrHaveThumb && !sceneChange && useIdx < 0 && !ctx->ltrSceneMarked && ctx->ltrStableFrames >= AVC_LTR_STABLE_FRAMES) {
+        // refresh the slot of the same scene, or take the next one, AVCLtrCommit stores it once encoded
+        int markIdx = (match >= 0) ? match : ctx->ltrNextSlot;
+        h264PicParams->ltrMarkFrame = 1;
+        h264PicParams->ltrMarkFrameIdx = markIdx;
+        frame->ltrMarked = true;
+        frame->ltrIdx = markIdx;
     }
-    return;
 }
 
-void AVCEncodeBuffer(AVCEncCtx context, uint32_t colorBuffer, uint64_t inTimestamp, int reqIDRFrame, IOStream *stream, uint32_t bitrate)
+// Paints the hint rects into roiMap in ascending weight order, one span per macroblock row
+static void AVCRoiRasterize(AVCEncoderContext* ctx)
 {
-    AVCEncoderContext* ctx = (AVCEncoderContext*) context;
-    NvEncBufferInfo* nvencBufInfo = NULL;
-    bool inputMapped = false;
-    int resIDRFrame = 0;
+    std::vector<const AVCRoiRect*> rects;
+    for (const AVCRoiHint& hint : ctx->roiHints)
+        rects.push_back(&hint.rect);
+    for (const AVCRoiRect& rect : ctx->roiFrameRects)
+        rects.push_back(&rect);
+    std::stable_sort(rects.begin(), rects.end(), [](const AVCRoiRect* a, const AVCRoiRect* b) { return a->weight < b->weight; });
+
+    int mbWidth = ctx->roiMapWidthInMBs;
+    int mbHeight = ctx->roiMapHeightInMBs;
+    std::fill(ctx->roiMap.begin(), ctx->roiMap.end(), 0);
+    for (const AVCRoiRect* rect : rects) {
+        // input pixels to macroblocks of the encoded picture, partially covered macroblocks are included
+        int x0 = std::max(0, (int)((int64_t)rect->x * ctx->encodeWidth / ctx->width) / 16);
+        int y0 = std::max(0, (int)((int64_t)rect->y * ctx->encodeHeight / ctx->height) / 16);
+        int x1 = std::min(mbWidth, (int)(((int64_t)(rect->x + rect->width) * ctx->encodeWidth / ctx->width + 15) / 16));
+        int y1 = std::min(mbHeight, (int)(((int64_t)(rect->y + rect->height) * ctx->encodeHeight / ctx->height + 15) / 16));
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+
+        int8_t qpOffset = (int8_t)std::max(-51, std::min(51, rect->qpOffset));
+        for (int y = y0; y < y1; y++)
+            memset(&ctx->roiMap[y * mbWidth + x0], qpOffset, x1 - x0);
+    }
+}
+
+// Returns the ROI map of the current frame, NULL without hints. Only re-rasterized when the hints,
+// their expiry or the macroblock grid change.
+static const int8_t* AVCRoiUpdate(AVCEncoderContext* ctx)
+{
+    std::lock_guard<std::mutex> guard(ctx->roiLock);
+
+    size_t count = ctx->roiHints.size();
+    ctx->roiHints.erase(std::remove_if(ctx->roiHints.begin(), ctx->roiHints.end(), [](const AVCRoiHint& hint) {
+        return hint.rect.lifetimeMs && sessionElapsedMs(hint.setTime) >= (int64_t)hint.rect.lifetimeMs;
+    }), ctx->roiHints.end());
+    if (ctx->roiHints.size() != count)
+        ctx->roiDirty = true;
+
+    if (ctx->roiHints.empty() && ctx->roiFrameRects.empty())
+        return NULL;
+
+    if (ctx->roiMapWidthInMBs != ctx->widthInMBs || ctx->roiMapHeightInMBs != ctx->heightInMBs) {
+        ctx->roiMapWidthInMBs = ctx->widthInMBs;
+        ctx->roiMapHeightInMBs = ctx->heightInMBs;
+        ctx->roiMap.resize(ctx->qpDeltaMapArraySize);
+        ctx->roiDirty = true;
+    }
+
+    if (ctx->roiDirty) {
+        AVCRoiRasterize(ctx);
+        ctx->roiDirty = false;
+    }
+    return ctx->roiMap.data();
+}
+
+static bool nvencInit(AVCEncoderContext* ctx, Codec codecType, int width, int height, int fps, int bitrate)
+{
+    if (AVCInitNvEncoder(ctx, codecType, width, height, fps, bitrate))
+        return true;
+
+    if (ctx->encoder) {
+        AVCDestroyOutputBuffers(ctx);
+        NVENC_API_CALL(ctx->nvenc.nvEncDestroyEncoder(ctx->encoder));
+    }
+    ctx->encoder = NULL;
+    if (ctx->eglContext != EGL_NO_CONTEXT)
+        destroyEGLResources(ctx);
+    ctx->eglContext = EGL_NO_CONTEXT;
+    ctx->eglSurface = EGL_NO_SURFACE;
+    delete ctx->reconfigParams.reInitEncodeParams.encodeConfig;
+    ctx->reconfigParams.reInitEncodeParams.encodeConfig = NULL;
+    // don't leave the qp state to a software fallback session
+    if (ctx->usesQp)
+        AVCReleaseQpState();
+    ctx->usesQp = false;
+    free(ctx->qpDeltaMapArray);
+    ctx->qpDeltaMapArray = NULL;
+    return false;
+}
+
+static bool nvencEncodeFrame(AVCEncoderContext* ctx, uint32_t colorBuffer, uint64_t inTimestamp, int reqIDRFrame, uint32_t bitrate, AVCEncodedFrame* frame)
+{
+    NV_ENC_REGISTERED_PTR registeredResource = NULL;
+    NV_ENC_OUTPUT_PTR outputBitstream;
     BufferMap_t::iterator it;
     GLuint tex;
-
-    // don't drop bitrate below minBitrate
-    if (bitrate < ctx->minBitrate)
-        bitrate = ctx->minBitrate;
+    bool recovery;
 
     if (ctx->bitrate != bitrate) {
         ctx->reconfigParams.reInitEncodeParams.encodeConfig->rcParams.averageBitRate = bitrate;
@@ -624,62 +1880,525 @@ void AVCEncodeBuffer(AVCEncCtx context, uint32_t colorBuffer, uint64_t inTimesta
         ctx->bitrate = bitrate;
     }
 
+    if (ctx->adaptiveResolution)
+        AVCUpdateEncodeScale(ctx, bitrate);
+
     if (pauseStream && ctx->isIVS) {
-        nvencBufInfo = ctx->overwriteNvencBufInfo;
+        tex = ctx->overwriteTex;
+        registeredResource = ctx->overwriteInput.registeredResource;
     }
     else {
         ColorBufferPtr cb = FrameBuffer::getFB()->getColorBuffer_locked(colorBuffer);
         if (!cb) {
             HDLOGE(":::: %s invalid colorBuffer(0x%x)\n", __FUNCTION__, colorBuffer);
-            goto err;
+            return false;
         }
 
         tex = cb->getEGLTexture();
-        it = ctx->bufferMap.find(tex);
-        if (it == ctx->bufferMap.end()) {
-            nvencBufInfo = new NvEncBufferInfo;
+        // a downscaled input is blitted below, the texture itself is only registered at full size
+        if (!ctx->scaleStep) {
+            it = ctx->bufferMap.find(tex);
+            if (it == ctx->bufferMap.end()) {
+                // input is stored in texture backing buffer, register it
+                registeredResource = AVCRegisterInputTexture(ctx, &ctx->bufferMap[tex], tex, ctx->width, ctx->height);
+                if (!registeredResource) {
+                    ctx->bufferMap.erase(tex);
+                    return false;
+                }
+                avcCbSet.insert(colorBuffer);
+            }
+            else
+                registeredResource = it->second.registeredResource;
+        }
+    }
 
-            // input is stored in texture backing buffer, register it
-            if (!AVCPrepareIOBuffers(ctx, nvencBufInfo, tex))
-                goto err;
+    if (ctx->scaleStep && tex)
+        registeredResource = AVCScaleInput(ctx, tex);
 
-            ctx->bufferMap.insert(std::pair<GLuint, NvEncBufferInfo*> (tex, nvencBufInfo));
-            avcCbSet.insert(colorBuffer);
-        }
-        else
-            nvencBufInfo = it->second;
+    if (!registeredResource)
+        return false;
+
+    // recover from the last marked LTR when there is one, IDR otherwise
+    recovery = (reqIDRFrame == AVC_REQ_LTR_RECOVERY && ctx->ltrFrames && ctx->ltrLastMarked >= 0);
+    if (recovery)
+        reqIDRFrame = 0;
+    frame->ltrIdx = -1;
+    if (ctx->ltrFrames && !reqIDRFrame)
+        AVCLtrPrepare(ctx, tex, recovery, frame);
+    else if (ctx->ltrFrames) {
+        ctx->picParams.codecPicParams.h264PicParams.ltrMarkFrame = 0;
+        ctx->picParams.codecPicParams.h264PicParams.ltrUseFrames = 0;
     }
 
-    if (qpData.isQpEnabled)
-        useQpdeltaStrategy(nvencBufInfo, bitrate);
+    if (ctx->usesQp)
+        useQpdeltaStrategy(ctx, &ctx->picParams, bitrate, AVCRoiUpdate(ctx));
 
     // map input resource
-    NVENC_API_CALL_GOTO(ctx->nvenc.nvEncMapInputResource(ctx->encoder, &(nvencBufInfo->mapInputResource)), err);
-    nvencBufInfo->picParams.inputBuffer = nvencBufInfo->mapInputResource.mappedResource;
-    inputMapped = true;
+    ctx->mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
+    ctx->mapInputResource.registeredResource = registeredResource;
+    NVENC_API_CALL_RET(ctx->nvenc.nvEncMapInputResource(ctx->encoder, &(ctx->mapInputResource)), false);
+    ctx->picParams.inputBuffer = ctx->mapInputResource.mappedResource;
+
+    // take the next output buffer of the pool
+    outputBitstream = ctx->outputPool[ctx->outputPoolIndex];
+    ctx->outputPoolIndex = (ctx->outputPoolIndex + 1) % AVC_OUTPUT_POOL_DEPTH;
+    ctx->picParams.outputBitstream = outputBitstream;
+    ctx->lockBitstreamData.outputBitstream = outputBitstream;
 
     // encode buffer
     if (reqIDRFrame) {
         if (!ctx->isIVS)
             HDLOGI("Request IDR frame\n");
-        nvencBufInfo->picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+        ctx->picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
         //picParams.codecPicParams.h264PicParams.constrainedFrame = 1;
     }
     else
-        nvencBufInfo->picParams.encodePicFlags = 0;
-    nvencBufInfo->picParams.inputTimeStamp = inTimestamp;
+        ctx->picParams.encodePicFlags = 0;
+    ctx->picParams.inputTimeStamp = inTimestamp;
 
-    NVENC_API_CALL_GOTO(ctx->nvenc.nvEncEncodePicture(ctx->encoder, &(nvencBufInfo->picParams)), err);
+    NVENC_API_CALL_GOTO(ctx->nvenc.nvEncEncodePicture(ctx->encoder, &(ctx->picParams)), err);
 
     // get encoded output
-    NVENC_API_CALL_GOTO(ctx->nvenc.nvEncLockBitstream(ctx->encoder, &(nvencBufInfo->lockBitstreamData)), err);
-    //HDLOGI("frame encoded size=%d type=%x\n", nvencBufInfo->lockBitstreamData.bitstreamSizeInBytes, nvencBufInfo->lockBitstreamData.pictureType);
-    if (nvencBufInfo->lockBitstreamData.pictureType == NV_ENC_PIC_TYPE_IDR)
-        resIDRFrame = 1;
+    NVENC_API_CALL_GOTO(ctx->nvenc.nvEncLockBitstream(ctx->encoder, &(ctx->lockBitstreamData)), err);
+    //HDLOGI("frame encoded size=%d type=%x\n", ctx->lockBitstreamData.bitstreamSizeInBytes, ctx->lockBitstreamData.pictureType);
+    frame->data = ctx->lockBitstreamData.bitstreamBufferPtr;
+    frame->size = ctx->lockBitstreamData.bitstreamSizeInBytes;
+    frame->isIDR = (ctx->lockBitstreamData.pictureType == NV_ENC_PIC_TYPE_IDR);
+    frame->temporalId = ctx->lockBitstreamData.temporalId;
+    frame->qp = ctx->lockBitstreamData.frameAvgQP;
+    switch (ctx->lockBitstreamData.pictureType) {
+        case NV_ENC_PIC_TYPE_P:     frame->pictureType = AVC_PIC_TYPE_P; break;
+        case NV_ENC_PIC_TYPE_B:     frame->pictureType = AVC_PIC_TYPE_B; break;
+        case NV_ENC_PIC_TYPE_I:     frame->pictureType = AVC_PIC_TYPE_I; break;
+        case NV_ENC_PIC_TYPE_IDR:   frame->pictureType = AVC_PIC_TYPE_IDR; break;
+        default:                    frame->pictureType = AVC_PIC_TYPE_UNKNOWN; break;
+    }
+    // an IDR drops all references, only an LTR marked on it survives
+    if (ctx->ltrFrames) {
+        if (frame->isIDR)
+            AVCLtrClear(ctx);
+        AVCLtrCommit(ctx, frame);
+    }
+    return true;
+
+err:
+    NVENC_API_CALL(ctx->nvenc.nvEncUnmapInputResource(ctx->encoder, ctx->mapInputResource.mappedResource));
+    return false;
+}
+
+static void nvencReleaseFrame(AVCEncoderContext* ctx)
+{
+    NVENC_API_CALL(ctx->nvenc.nvEncUnlockBitstream(ctx->encoder, ctx->lockBitstreamData.outputBitstream));
+    NVENC_API_CALL(ctx->nvenc.nvEncUnmapInputResource(ctx->encoder, ctx->mapInputResource.mappedResource));
+}
+
+static void nvencDestroy(AVCEncoderContext* ctx)
+{
+    // send EOS
+    NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
+    picParams.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
+    NVENC_API_CALL(ctx->nvenc.nvEncEncodePicture(ctx->encoder, &picParams));
+
+    // unregister input resources
+    for (BufferMap_t::iterator it = ctx->bufferMap.begin(); it != ctx->bufferMap.end(); ++it)
+        NVENC_API_CALL(ctx->nvenc.nvEncUnregisterResource(ctx->encoder, it->second.registeredResource));
+    ctx->bufferMap.clear();
+    if (ctx->overwriteInput.registeredResource)
+        NVENC_API_CALL(ctx->nvenc.nvEncUnregisterResource(ctx->encoder, ctx->overwriteInput.registeredResource));
+    for (int i = 0; i < AVC_SCALE_STEPS; i++) {
+        if (ctx->scaledInput[i].registeredResource)
+            NVENC_API_CALL(ctx->nvenc.nvEncUnregisterResource(ctx->encoder, ctx->scaledInput[i].registeredResource));
+    }
+
+    // destroy bitstream buffers
+    AVCDestroyOutputBuffers(ctx);
+    if (!ctx->isIVS)
+        avcCbSet.clear();
+
+    if (qpData.isQpEnabled)
+        AVCReleaseQpState();
+    free(ctx->qpDeltaMapArray);
+    ctx->qpDeltaMapArray = NULL;
+
+    // destroy encoder
+    NVENC_API_CALL(ctx->nvenc.nvEncDestroyEncoder(ctx->encoder));
+
+    if (ctx->overwriteTex)
+        glDeleteTextures(1, &ctx->overwriteTex);
+    for (int i = 0; i < AVC_SCALE_STEPS; i++) {
+        if (ctx->scaledTex[i])
+            glDeleteTextures(1, &ctx->scaledTex[i]);
+    }
+    if (ctx->ltrThumbTex)
+        glDeleteTextures(1, &ctx->ltrThumbTex);
+    if (ctx->ltrLevels)
+        glDeleteTextures(ctx->ltrLevels, ctx->ltrLevelTex);
+    if (ctx->ltrPbo[0])
+        glDeleteBuffers(2, ctx->ltrPbo);
+    if (ctx->blitFbo[0])
+        glDeleteFramebuffers(2, ctx->blitFbo);
+
+    destroyEGLResources(ctx);
+    delete ctx->reconfigParams.reInitEncodeParams.encodeConfig;
+}
+
+static const AVCEncoderBackend nvencBackend = {
+    "nvenc",
+    nvencInit,
+    nvencEncodeFrame,
+    nvencReleaseFrame,
+    nvencDestroy,
+};
+
+static bool swLoadX264(AVCSwEncoder* sw)
+{
+    static std::mutex loadLock;
+    static void* handle = NULL;
+
+    std::lock_guard<std::mutex> guard(loadLock);
+    if (!handle) {
+        // runtime packages only ship the versioned name, the unversioned one is the dev symlink
+        handle = dlopen("libx264.so." AVC_XSTR(X264_BUILD), RTLD_LAZY);
+        if (!handle)
+            handle = dlopen("libx264.so", RTLD_LAZY);
+        if (!handle) {
+            HDLOGE(":::: %s dlopen libx264.so." AVC_XSTR(X264_BUILD) " failed error=%s\n", __FUNCTION__, dlerror());
+            return false;
+        }
+    }
+
+    sw->x264ParamDefaultPreset = (x264ParamDefaultPreset_t) dlsym(handle, "x264_param_default_preset");
+    sw->x264ParamApplyProfile = (x264ParamApplyProfile_t) dlsym(handle, "x264_param_apply_profile");
+    sw->x264EncoderOpen = (x264EncoderOpen_t) dlsym(handle, "x264_encoder_open_" AVC_XSTR(X264_BUILD));
+    sw->x264EncoderReconfig = (x264EncoderReconfig_t) dlsym(handle, "x264_encoder_reconfig");
+    sw->x264EncoderEncode = (x264EncoderEncode_t) dlsym(handle, "x264_encoder_encode");
+    sw->x264EncoderClose = (x264EncoderClose_t) dlsym(handle, "x264_encoder_close");
+    sw->x264PictureInit = (x264PictureInit_t) dlsym(handle, "x264_picture_init");
+    if (!sw->x264ParamDefaultPreset || !sw->x264ParamApplyProfile || !sw->x264EncoderOpen || !sw->x264EncoderReconfig ||
+        !sw->x264EncoderEncode || !sw->x264EncoderClose || !sw->x264PictureInit) {
+        HDLOGE(":::: %s dlsym x264 API failed error=%s\n", __FUNCTION__, dlerror());
+        return false;
+    }
+    return true;
+}
+
+static void swFree(AVCSwEncoder* sw)
+{
+    if (sw->encoder)
+        sw->x264EncoderClose(sw->encoder);
+    free(sw->rgba);
+    free(sw->scaled);
+    free(sw->nv12);
+    delete sw;
+}
+
+static bool swInit(AVCEncoderContext* ctx, Codec codecType, int width, int height, int fps, int bitrate)
+{
+    if (codecType != H264) {
+        HDLOGE(":::: %s software fallback only supports H264, codecType=%d\n", __FUNCTION__, codecType);
+        return false;
+    }
+
+    AVCSwEncoder* sw = new AVCSwEncoder();
+    if (!swLoadX264(sw)) {
+        delete sw;
+        return false;
+    }
+
+    sw->scaleShift = ctx->swScaleShift;
+    sw->encodeWidth = (width >> sw->scaleShift) & ~1;
+    sw->encodeHeight = (height >> sw->scaleShift) & ~1;
+    sw->rgba = (uint8_t*) malloc(width * height * 4);
+    if (sw->scaleShift)
+        sw->scaled = (uint8_t*) malloc(sw->encodeWidth * sw->encodeHeight * 4);
+    sw->nv12 = (uint8_t*) malloc(sw->encodeWidth * sw->encodeHeight * 3 / 2);
+    if (!sw->rgba || (sw->scaleShift && !sw->scaled) || !sw->nv12) {
+        HDLOGE(":::: %s out of memory\n", __FUNCTION__);
+        swFree(sw);
+        return false;
+    }
+
+    if (sw->x264ParamDefaultPreset(&sw->param, "veryfast", "zerolatency") < 0) {
+        HDLOGE(":::: %s x264_param_default_preset failed\n", __FUNCTION__);
+        swFree(sw);
+        return false;
+    }
+    sw->param.i_width = sw->encodeWidth;
+    sw->param.i_height = sw->encodeHeight;
+    sw->param.i_csp = X264_CSP_NV12;
+    sw->param.i_fps_num = fps;
+    sw->param.i_fps_den = 1;
+    sw->param.i_threads = AVC_SW_ENCODE_THREADS;
+    sw->param.b_repeat_headers = 1;
+    sw->param.b_annexb = 1;
+    sw->param.rc.i_rc_method = X264_RC_ABR;
+    sw->param.rc.i_bitrate = bitrate / 1000;
+    sw->param.rc.i_vbv_max_bitrate = bitrate / 1000;
+    sw->param.rc.i_vbv_buffer_size = bitrate / 1000;
+    sw->x264ParamApplyProfile(&sw->param, "baseline");
+
+    sw->encoder = sw->x264EncoderOpen(&sw->param);
+    if (!sw->encoder) {
+        HDLOGE(":::: %s x264_encoder_open failed\n", __FUNCTION__);
+        swFree(sw);
+        return false;
+    }
+
+    ctx->bitrate = bitrate;
+    ctx->minBitrate = bitrate / 2.5;
+    ctx->swEncoder = sw;
+    HDLOGI("%s: software fallback encodes %dx%d\n", __FUNCTION__, sw->encodeWidth, sw->encodeHeight);
+    return true;
+}
+
+static bool swEncodeFrame(AVCEncoderContext* ctx, uint32_t colorBuffer, uint64_t inTimestamp, int reqIDRFrame, uint32_t bitrate, AVCEncodedFrame* frame)
+{
+    AVCSwEncoder* sw = ctx->swEncoder;
+
+    if (ctx->bitrate != bitrate) {
+        sw->param.rc.i_bitrate = bitrate / 1000;
+        sw->param.rc.i_vbv_max_bitrate = bitrate / 1000;
+        if (sw->x264EncoderReconfig(sw->encoder, &sw->param) < 0)
+            HDLOGE(":::: %s x264_encoder_reconfig failed\n", __FUNCTION__);
+        ctx->bitrate = bitrate;
+    }
+
+    if (pauseStream && ctx->isIVS) {
+        memset(sw->rgba, 0, ctx->width * ctx->height * 4);
+    }
+    else {
+        ColorBufferPtr cb = FrameBuffer::getFB()->getColorBuffer_locked(colorBuffer);
+        if (!cb) {
+            HDLOGE(":::: %s invalid colorBuffer(0x%x)\n", __FUNCTION__, colorBuffer);
+            return false;
+        }
+        cb->readPixels(0, 0, ctx->width, ctx->height, GL_RGBA, GL_UNSIGNED_BYTE, sw->rgba);
+    }
+
+    const uint8_t* src = sw->rgba;
+    int srcPitch = ctx->width * 4;
+    if (sw->scaleShift) {
+        AVCDownscaleABGR2x(sw->rgba, srcPitch, sw->encodeWidth, sw->encodeHeight, sw->scaled, sw->encodeWidth * 4);
+        src = sw->scaled;
+        srcPitch = sw->encodeWidth * 4;
+    }
+    uint8_t* dstY = sw->nv12;
+    uint8_t* dstUV = sw->nv12 + sw->encodeWidth * sw->encodeHeight;
+    AVCConvertABGRToNV12(src, srcPitch, sw->encodeWidth, sw->encodeHeight, dstY, sw->encodeWidth, dstUV, sw->encodeWidth, AVC_SW_CONVERT_THREADS);
+
+    x264_picture_t picIn;
+    x264_picture_t picOut;
+    sw->x264PictureInit(&picIn);
+    picIn.img.i_csp = X264_CSP_NV12;
+    picIn.img.i_plane = 2;
+    picIn.img.plane[0] = dstY;
+    picIn.img.plane[1] = dstUV;
+    picIn.img.i_stride[0] = sw->encodeWidth;
+    picIn.img.i_stride[1] = sw->encodeWidth;
+    picIn.i_pts = inTimestamp;
+    picIn.i_type = reqIDRFrame ? X264_TYPE_IDR : X264_TYPE_AUTO;
+
+    x264_nal_t* nals = NULL;
+    int numNals = 0;
+    int size = sw->x264EncoderEncode(sw->encoder, &nals, &numNals, &picIn, &picOut);
+    if (size <= 0 || !numNals) {
+        if (size < 0)
+            HDLOGE(":::: %s x264_encoder_encode failed\n", __FUNCTION__);
+        return false;
+    }
+
+    // x264 guarantees the NAL payloads of one frame are contiguous
+    frame->data = nals[0].p_payload;
+    frame->size = size;
+    frame->isIDR = (picOut.i_type == X264_TYPE_IDR);
+    frame->temporalId = 0;
+    frame->qp = -1;     // x264 doesn't report the frame QP through the public API
+    switch (picOut.i_type) {
+        case X264_TYPE_IDR:         frame->pictureType = AVC_PIC_TYPE_IDR; break;
+        case X264_TYPE_I:           frame->pictureType = AVC_PIC_TYPE_I; break;
+        case X264_TYPE_P:           frame->pictureType = AVC_PIC_TYPE_P; break;
+        default:                    frame->pictureType = AVC_PIC_TYPE_UNKNOWN; break;
+    }
+    return true;
+}
+
+static void swReleaseFrame(AVCEncoderContext* ctx)
+{
+    // output stays owned by x264 until the next encode call
+}
+
+static void swDestroy(AVCEncoderContext* ctx)
+{
+    if (ctx->swEncoder)
+        swFree(ctx->swEncoder);
+    ctx->swEncoder = NULL;
+}
+
+static const AVCEncoderBackend swBackend = {
+    "x264",
+    swInit,
+    swEncodeFrame,
+    swReleaseFrame,
+    swDestroy,
+};
+
+AVCEncCtx AVCCreateEncoderEx(int codec, int width, int height, int fps, int bitrate, const AVCEncoderOptions* options)
+{
+    AVCEncoderContext* ctx = new AVCEncoderContext();
+    Codec codecType = (Codec)codec;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->fps = fps;
+    ctx->temporalLayers = std::min(options->temporalLayers, AVC_MAX_TEMPORAL_LAYERS);
+    ctx->swScaleShift = std::max(0, std::min(options->softwareScaleShift, 1));
+    ctx->framingVersion = AVCNegotiateFramingVersion(options->framingVersion);
+    ctx->encodeWidth = width;
+    ctx->encodeHeight = height;
+    gettimeofday(&ctx->scaleCheckTime, NULL);
+    ctx->ltrFrames = std::max(0, std::min(options->ltrFrames, AVC_MAX_LTR_FRAMES));
+    ctx->ltrLastMarked = -1;
+
+    if (sessionAdmit(ctx, options, true)) {
+        if (nvencInit(ctx, codecType, width, height, fps, bitrate)) {
+            AVCEncoderCaps caps;
+            ctx->backend = &nvencBackend;
+            ctx->adaptiveResolution = options->adaptiveResolution && AVCGetEncoderCaps(&caps) && caps.dynamicResolution;
+        }
+        else
+            sessionRelease(ctx);
+    }
+
+    // no NVENC slot or library, keep the stream alive on the CPU
+    if (!ctx->backend && options->softwareFallback) {
+        // x264 runs without temporal layers or long-term references
+        ctx->temporalLayers = 0;
+        ctx->ltrFrames = 0;
+        sessionAdmit(ctx, options, false);
+        if (swInit(ctx, codecType, width, height, fps, bitrate))
+            ctx->backend = &swBackend;
+        else
+            sessionRelease(ctx);
+    }
+
+    if (!ctx->backend) {
+        delete ctx;
+        return 0;
+    }
+
+    // track encoder
+    RenderThreadInfo* const tinfo = RenderThreadInfo::get();
+    FrameBuffer::getFB()->lock();
+    tinfo->m_avcEncSet.insert((AVCEncCtx)ctx);
+    FrameBuffer::getFB()->unlock();
+
+    HDLOGI("AVC encoder created=0x%" PRIx64 " backend=%s codec=%s width=%d height=%d fps=%d bitrate=%d minBitrate=%d encSessionsCount=%d isIVS=%d priority=%d decimation=%d temporalLayers=%d framing=%d adaptiveResolution=%d ltrFrames=%d\n", (AVCEncCtx)ctx, ctx->backend->name, (codecType==AV1)?"AV1":"H264", width, height, fps, bitrate, ctx->minBitrate, encSessionsCount, ctx->isIVS, ctx->priority, ctx->baseDecimation, ctx->temporalLayers, ctx->framingVersion, ctx->adaptiveResolution, ctx->ltrFrames);
+    return (AVCEncCtx) ctx;
+}
 
-    stream->writeFully(&(nvencBufInfo->lockBitstreamData.bitstreamSizeInBytes), 4);
-    stream->writeFully(&resIDRFrame, 4);
-    stream->writeFully(nvencBufInfo->lockBitstreamData.bitstreamBufferPtr, nvencBufInfo->lockBitstreamData.bitstreamSizeInBytes);
+AVCEncCtx AVCCreateEncoder(int codec, int width, int height, int fps, int bitrate)
+{
+    AVCEncoderOptions options;
+    AVCInitEncoderOptions(&options);
+    return AVCCreateEncoderEx(codec, width, height, fps, bitrate, &options);
+}
+
+void AVCSetRoiHints(AVCEncCtx context, const AVCRoiRect* rects, int count)
+{
+    AVCEncoderContext* ctx = (AVCEncoderContext*) context;
+    if (count > AVC_MAX_ROI_RECTS) {
+        HDLOGE(":::: %s %d hints, only %d are used\n", __FUNCTION__, count, AVC_MAX_ROI_RECTS);
+        count = AVC_MAX_ROI_RECTS;
+    }
+
+    timeval now;
+    gettimeofday(&now, NULL);
+    std::lock_guard<std::mutex> guard(ctx->roiLock);
+    ctx->roiHints.clear();
+    for (int i = 0; i < count; i++)
+        ctx->roiHints.push_back({ rects[i], now });
+    ctx->roiDirty = true;
+}
+
+static void AVCSetRoiFrameRects(AVCEncoderContext* ctx, const AVCRoiRect* rects, int count)
+{
+    count = std::max(0, std::min(count, AVC_MAX_ROI_RECTS));
+
+    std::lock_guard<std::mutex> guard(ctx->roiLock);
+    // same hints as the previous frame keep the cached map
+    if (ctx->roiFrameRects.size() == (size_t)count &&
+        (!count || !memcmp(ctx->roiFrameRects.data(), rects, count * sizeof(AVCRoiRect))))
+        return;
+
+    ctx->roiFrameRects.assign(rects, rects + count);
+    ctx->roiDirty = true;
+}
+
+void AVCEncodeBuffer(AVCEncCtx context, uint32_t colorBuffer, uint64_t inTimestamp, int reqIDRFrame, IOStream *stream, uint32_t bitrate)
+{
+    AVCEncodeBufferEx(context, colorBuffer, inTimestamp, reqIDRFrame, stream, bitrate, NULL, 0);
+}
+
+void AVCEncodeBufferEx(AVCEncCtx context, uint32_t colorBuffer, uint64_t inTimestamp, int reqIDRFrame, IOStream *stream, uint32_t bitrate,
+                       const AVCRoiRect* frameRects, int frameRectCount)
+{
+    AVCEncoderContext* ctx = (AVCEncoderContext*) context;
+    AVCEncodedFrame frame = {};
+    int resFrameInfo = 0;
+    timeval encodeStartTime;
+    uint32_t encodeTimeUs;
+
+    AVCSetRoiFrameRects(ctx, frameRects, frameRects ? frameRectCount : 0);
+
+    // drop frames of sessions throttled by the session manager, unless an IDR is requested
+    if (ctx->decimation > 1 && (ctx->frameCount++ % ctx->decimation) != 0 && !reqIDRFrame) {
+        uint32_t outBufferSize = 0;
+        stream->writeFully(&outBufferSize, 4);
+        return;
+    }
+
+    // don't drop bitrate below minBitrate
+    if (bitrate < ctx->minBitrate)
+        bitrate = ctx->minBitrate;
+
+    gettimeofday(&encodeStartTime, NULL);
+    if (!ctx->backend->encodeFrame(ctx, colorBuffer, inTimestamp, reqIDRFrame, bitrate, &frame)) {
+        uint32_t outBufferSize = 0;
+        stream->writeFully(&outBufferSize, 4);
+        return;
+    }
+
+    if (frame.isIDR)
+        resFrameInfo |= AVC_FRAME_INFO_IDR;
+    if (ctx->temporalLayers > 1)
+        resFrameInfo |= (frame.temporalId << AVC_FRAME_INFO_TID_SHIFT) & AVC_FRAME_INFO_TID_MASK;
+    if (frame.ltrMarked)
+        resFrameInfo |= AVC_FRAME_INFO_LTR_MARK;
+    if (frame.ltrUsed)
+        resFrameInfo |= AVC_FRAME_INFO_LTR_USE;
+    if (frame.ltrMarked || frame.ltrUsed)
+        resFrameInfo |= (frame.ltrIdx << AVC_FRAME_INFO_LTR_IDX_SHIFT) & AVC_FRAME_INFO_LTR_IDX_MASK;
+    encodeTimeUs = (uint32_t)sessionElapsedUs(encodeStartTime);
+    if (ctx->isHwSession)
+        sessionReportEncodeTime(ctx, encodeTimeUs);
+
+    stream->writeFully(&frame.size, 4);
+    if (ctx->framingVersion >= AVC_FRAMING_V2) {
+        AVCFrameHeaderV2 header = {};
+        header.version = AVC_FRAMING_V2;
+        header.headerSize = sizeof(AVCFrameHeaderV2);
+        header.pictureType = frame.pictureType;
+        header.temporalId = frame.temporalId;
+        header.frameInfo = resFrameInfo;
+        header.sequence = ctx->sequence++;
+        header.qp = frame.qp;
+        header.inTimestamp = inTimestamp;
+        header.encodeTimeUs = encodeTimeUs;
+        header.bitrate = bitrate;
+        stream->writeFully(&header, sizeof(header));
+    }
+    else
+        stream->writeFully(&resFrameInfo, 4);
+    stream->writeFully(frame.data, frame.size);
 
     if (dynQpAdjust) {
         static uint32_t suitableBrtNumInSec = 0;
@@ -695,22 +2414,13 @@ void AVCEncodeBuffer(AVCEncCtx context, uint32_t colorBuffer, uint64_t inTimesta
         }
         if(dynQpAdjust->dynQpDeltaAdjust_get_mDynQpAdjustAllowed()) {
             uint32_t  encodedSize = dynQpAdjust->dynQpDeltaAdjust_get_kTotalEncodedSizeInBytes();
-            encodedSize += nvencBufInfo->lockBitstreamData.bitstreamSizeInBytes;
+            encodedSize += frame.size;
             int* mode = reinterpret_cast<int*>(dynQpAdjust->qpDeltaModeSelect(encodedSize, suitableBrtNumInSec));
             dynQpAdjust->dynQpDeltaAdjust_set_mQpDeltaMode(*mode);
         }
     }
     // free resources
-    NVENC_API_CALL(ctx->nvenc.nvEncUnlockBitstream(ctx->encoder, nvencBufInfo->lockBitstreamData.outputBitstream));
-    NVENC_API_CALL(ctx->nvenc.nvEncUnmapInputResource(ctx->encoder, nvencBufInfo->mapInputResource.mappedResource));
-    inputMapped = false;
-    return;
-
-err:
-    if (inputMapped)
-        NVENC_API_CALL(ctx->nvenc.nvEncUnmapInputResource(ctx->encoder, nvencBufInfo->mapInputResource.mappedResource));
-    uint32_t outBufferSize = 0;
-    stream->writeFully(&outBufferSize, 4);
+    ctx->backend->releaseFrame(ctx);
 }
 
 void AVCDestroyEncoder(AVCEncCtx context)
@@ -720,54 +2430,15 @@ void AVCDestroyEncoder(AVCEncCtx context)
     // Disable the OSD
     osdInfo.OSDEnabled = 0;
 
-    // send EOS
-    NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
-    picParams.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
-    NVENC_API_CALL(ctx->nvenc.nvEncEncodePicture(ctx->encoder, &picParams));
-
-    for (BufferMap_t::iterator it = ctx->bufferMap.begin(); it != ctx->bufferMap.end(); ++it) {
-        // unregister input resources
-        NVENC_API_CALL(ctx->nvenc.nvEncUnregisterResource(ctx->encoder, it->second->mapInputResource.registeredResource));
-
-        // destroy bitstream buffer
-        NVENC_API_CALL(ctx->nvenc.nvEncDestroyBitstreamBuffer(ctx->encoder, it->second->picParams.outputBitstream));
-
-        delete it->second;
-        it->second = NULL;
-    }
-    if (!ctx->isIVS)
-        avcCbSet.clear();
-
-    if (qpData.isQpEnabled) {
-        free(qpData.qpDeltaMapArray);
-        qpData.qpDeltaMapArray = NULL;
-        qpData.isQpEnabled = false;
-        if (dynQpAdjust) {
-            delete dynQpAdjust;
-            dynQpAdjust = NULL;
-        }
-    }
-
-    // destroy encoder
-    NVENC_API_CALL(ctx->nvenc.nvEncDestroyEncoder(ctx->encoder));
+    ctx->backend->destroy(ctx);
 
     // untrack encoder
     RenderThreadInfo* const tinfo = RenderThreadInfo::get();
     tinfo->m_avcEncSet.erase(context);
 
-    if (ctx->overwriteTex)
-        glDeleteTextures(1, &ctx->overwriteTex);
-    if (ctx->overwriteNvencBufInfo)
-        delete ctx->overwriteNvencBufInfo;
-
-    destroyEGLResources(ctx);
-    encSessionsCount--;
-    if (encSessionsCount <= 1) {
-        pauseStream = false;
-    }
-    HDLOGI("AVC encoder destroyed=0x%" PRIx64 " encSessionsCount=%d isIVS=%d\n", context, encSessionsCount, ctx->isIVS);
+    sessionRelease(ctx);
+    HDLOGI("AVC encoder destroyed=0x%" PRIx64 " backend=%s encSessionsCount=%d isIVS=%d\n", context, ctx->backend->name, encSessionsCount, ctx->isIVS);
 
-    delete ctx->reconfigParams.reInitEncodeParams.encodeConfig;
     delete ctx;
     ctx = NULL;
 }
@@ -15,10 +15,6 @@
 
 typedef struct {
     bool     isQpEnabled;
-    uint32_t widthInMBs;
-    uint32_t heightInMBs;
-    uint32_t qpDeltaMapArraySize;
-    int8_t*  qpDeltaMapArray;
     int      lowBitQpValue;
     int      mediumBitQpValue;
     int      highBitQpValue;
@@ -28,10 +24,127 @@ typedef struct {
     }
 } QpData;
 
+typedef enum {
+    AVC_SESSION_ROLE_AUTO = 0,          // streamer if none is running yet, IVS otherwise
+    AVC_SESSION_ROLE_STREAMER,
+    AVC_SESSION_ROLE_IVS,
+} AVCSessionRole;
+
+typedef enum {
+    AVC_SESSION_PRIORITY_DEFAULT = 0,   // derived from the role
+    AVC_SESSION_PRIORITY_LOW,
+    AVC_SESSION_PRIORITY_NORMAL,
+    AVC_SESSION_PRIORITY_HIGH,
+} AVCSessionPriority;
+
+// Output framing is [size:4][frameInfo:4][payload]. frameInfo carries the IDR flag and, when
+// temporal SVC is enabled, the temporal layer id so relays can drop enhancement layers.
+#define AVC_FRAME_INFO_IDR              0x1
+#define AVC_FRAME_INFO_TID_SHIFT        8
+#define AVC_FRAME_INFO_TID_MASK         0xff00
+#define AVC_MAX_TEMPORAL_LAYERS         3
+// With long-term references enabled frameInfo also tells which frames are stored or referenced as LTR
+#define AVC_FRAME_INFO_LTR_MARK         0x2     // frame is stored in LTR slot LTR_IDX
+#define AVC_FRAME_INFO_LTR_USE          0x4     // frame only references LTR slot LTR_IDX
+#define AVC_FRAME_INFO_LTR_IDX_SHIFT    16
+#define AVC_FRAME_INFO_LTR_IDX_MASK     0xf0000
+#define AVC_MAX_LTR_FRAMES              4
+
+// reqIDRFrame values of AVCEncodeBuffer
+#define AVC_REQ_IDR                     1
+#define AVC_REQ_LTR_RECOVERY            2       // predict from the last marked LTR, IDR if there is none
+
+// Framing v2 replaces the frameInfo word with AVCFrameHeaderV2: [size:4][AVCFrameHeaderV2][payload].
+// It is only used when negotiated, a dropped frame is still a bare [size=0:4] in both versions.
+#define AVC_FRAMING_V1                  1
+#define AVC_FRAMING_V2                  2
+#define AVC_FRAMING_VERSION_MAX         AVC_FRAMING_V2
+
+typedef enum {
+    AVC_PIC_TYPE_P = 0,
+    AVC_PIC_TYPE_B,
+    AVC_PIC_TYPE_I,
+    AVC_PIC_TYPE_IDR,
+    AVC_PIC_TYPE_UNKNOWN = 0xff,
+} AVCPictureType;
+
+typedef struct {
+    uint8_t     version;            // AVC_FRAMING_V2
+    uint8_t     headerSize;         // sizeof(AVCFrameHeaderV2), later versions only append fields
+    uint8_t     pictureType;        // AVCPictureType
+    uint8_t     temporalId;
+    uint32_t    frameInfo;          // same bits as the v1 frameInfo word
+    uint32_t    sequence;           // +1 per output frame, gaps are frames lost downstream
+    int32_t     qp;                 // average QP of the frame, -1 if the backend doesn't report it
+    uint64_t    inTimestamp;        // timestamp passed to AVCEncodeBuffer
+    uint32_t    encodeTimeUs;
+    uint32_t    bitrate;            // bitrate applied to this frame
+} AVCFrameHeaderV2;
+
+typedef struct {
+    AVCSessionRole      role;
+    AVCSessionPriority  priority;
+    int                 temporalLayers;     // H264 temporal SVC layers, 0 or 1 disables SVC
+    bool                softwareFallback;   // encode on the CPU when no NVENC session is available
+    int                 softwareScaleShift; // software fallback encodes at input size >> shift (0 or 1)
+    int                 framingVersion;     // AVC_FRAMING_*, see AVCNegotiateFramingVersion
+    bool                adaptiveResolution; // lower the NVENC encode resolution (100/75/50%) on low bitrate per pixel
+    int                 ltrFrames;          // H264 long-term references for recurring scenes, 0 disables, not with SVC
+} AVCEncoderOptions;
+
+// Region of interest hint in input pixels, applied through the qp delta map when QP is enabled
+typedef struct {
+    int         x;
+    int         y;
+    int         width;
+    int         height;
+    int         qpOffset;           // added to the qp delta of the covered macroblocks, negative spends more bits
+    int         weight;             // higher weights paint over lower ones where rects overlap
+    uint32_t    lifetimeMs;         // session hints expire after lifetimeMs, 0 keeps them until replaced
+} AVCRoiRect;
+
+#define AVC_MAX_ROI_RECTS               16
+
+// NVENC capabilities, feature fields are those of H264
+typedef struct {
+    bool        h264;
+    bool        av1;
+    bool        lowLatencyPreset;   // one of the P2, P1, P3, P4 presets, picked in that order
+    bool        qpDeltaMap;         // Main profile CABAC encoding used with the qp delta map
+    bool        temporalSvc;
+    int         maxTemporalLayers;
+    int         maxLtrFrames;
+    bool        asyncEncode;
+    bool        subframeReadback;
+    bool        dynamicResolution;
+    int         maxWidth;
+    int         maxHeight;
+    uint64_t    maxMBPerSec;
+} AVCEncoderCaps;
+
+void AVCInitEncoderOptions(AVCEncoderOptions* options);
+// Capabilities are probed once per process with the first NVENC session, false until then
+bool AVCGetEncoderCaps(AVCEncoderCaps* caps);
+// returns the framing version to use with a client supporting up to clientMaxVersion
+int AVCNegotiateFramingVersion(int clientMaxVersion);
+// maxSessions and maxPixelRate (pixels per second over all sessions) of 0 mean unlimited
+void AVCSetSessionLimits(int maxSessions, uint64_t maxPixelRate);
+
 AVCEncCtx AVCCreateEncoder(int codec, int width, int height, int fps, int bitrate);
+AVCEncCtx AVCCreateEncoderEx(int codec, int width, int height, int fps, int bitrate, const AVCEncoderOptions* options);
 void AVCEncodeBuffer(AVCEncCtx context, uint32_t colorBuffer, uint64_t inTimestamp, int reqIDRFrame, IOStream *stream, uint32_t bitrate);
+// frameRects only apply to this frame, on top of the session hints
+void AVCEncodeBufferEx(AVCEncCtx context, uint32_t colorBuffer, uint64_t inTimestamp, int reqIDRFrame, IOStream *stream, uint32_t bitrate,
+                       const AVCRoiRect* frameRects, int frameRectCount);
+// Replaces the session hints, count 0 clears them
+void AVCSetRoiHints(AVCEncCtx context, const AVCRoiRect* rects, int count);
 void AVCDestroyEncoder(AVCEncCtx context);
 
+// Colour conversion of the software fallback, ABGR is R,G,B,A in memory. width and height must be even.
+void AVCConvertABGRToNV12(const uint8_t* src, int srcPitch, int width, int height, uint8_t* dstY, int yPitch,
+                          uint8_t* dstUV, int uvPitch, int numThreads);
+void AVCDownscaleABGR2x(const uint8_t* src, int srcPitch, int dstWidth, int dstHeight, uint8_t* dst, int dstPitch);
+
 #define MEMBER_REFLECT_ACCESSORS(type, field) \
 	 type dynQpDeltaAdjust_get_##field() \
 	 { \